@@ -0,0 +1,224 @@
+#include "Checkpoint.h"
+#include <cstring>
+#include <fstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a file mapped in memory as an array of ints
+struct MappedFile {
+	int* data = nullptr;
+	size_t bytes = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// maps the file at path; if bytes is 0 the whole existing file is mapped, otherwise the file is resized to bytes
+static bool mapFile(std::string path, size_t bytes, MappedFile& mf) {
+#ifdef _WIN32
+	mf.file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, bytes == 0 ? OPEN_EXISTING : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mf.file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	if (bytes == 0) {
+		LARGE_INTEGER size;
+		GetFileSizeEx(mf.file, &size);
+		bytes = (size_t)size.QuadPart;
+	}
+	if (bytes == 0) {
+		CloseHandle(mf.file);
+		return false;
+	}
+	mf.mapping = CreateFileMappingA(mf.file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32), (DWORD)(bytes & 0xFFFFFFFF), NULL);
+	if (mf.mapping == NULL) {
+		CloseHandle(mf.file);
+		return false;
+	}
+	mf.data = (int*)MapViewOfFile(mf.mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+	if (mf.data == nullptr) {
+		CloseHandle(mf.mapping);
+		CloseHandle(mf.file);
+		return false;
+	}
+#else
+	mf.fd = open(path.c_str(), bytes == 0 ? O_RDWR : O_RDWR | O_CREAT, 0644);
+	if (mf.fd == -1) {
+		return false;
+	}
+	if (bytes == 0) {
+		struct stat st;
+		fstat(mf.fd, &st);
+		bytes = (size_t)st.st_size;
+	}
+	else if (ftruncate(mf.fd, bytes) != 0) {
+		close(mf.fd);
+		return false;
+	}
+	if (bytes == 0) {
+		close(mf.fd);
+		return false;
+	}
+	void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mf.fd, 0);
+	if (addr == MAP_FAILED) {
+		close(mf.fd);
+		return false;
+	}
+	mf.data = (int*)addr;
+#endif
+	mf.bytes = bytes;
+	return true;
+}
+
+// flushes the mapped pages to disk and releases the mapping
+static void unmapFile(MappedFile& mf) {
+#ifdef _WIN32
+	FlushViewOfFile(mf.data, mf.bytes);
+	UnmapViewOfFile(mf.data);
+	CloseHandle(mf.mapping);
+	CloseHandle(mf.file);
+#else
+	msync(mf.data, mf.bytes, MS_SYNC);
+	munmap(mf.data, mf.bytes);
+	close(mf.fd);
+#endif
+	mf.data = nullptr;
+}
+
+// writes ints to the file at path through a mapping; the file gets exactly offset + ints.size() ints
+static bool writeInts(std::string path, size_t offset, const std::vector<int>& ints) {
+	if (offset + ints.size() == 0) {
+		// nothing to map; just make sure the file exists and is empty
+		std::ofstream(path, std::ios::binary | std::ios::trunc);
+		return true;
+	}
+	MappedFile mf;
+	if (!mapFile(path, (offset + ints.size()) * sizeof(int), mf)) {
+		return false;
+	}
+	std::memcpy(mf.data + offset, ints.data(), ints.size() * sizeof(int));
+	unmapFile(mf);
+	return true;
+}
+
+// reads the whole file at path through a mapping
+static bool readInts(std::string path, std::vector<int>& ints) {
+	MappedFile mf;
+	if (!mapFile(path, 0, mf)) {
+		return false;
+	}
+	ints.assign(mf.data, mf.data + mf.bytes / sizeof(int));
+	unmapFile(mf);
+	return true;
+}
+
+Checkpoint::Checkpoint(std::string path) {
+	this->path = path;
+}
+
+bool Checkpoint::save(const CheckpointData& data, const std::vector<SetOperationFramework>& delivered) {
+	// the delivered notifications first: only the ones that are not in the log file yet
+	if (delivered.size() < this->savedEntries) {
+		// the log can only grow; start over if we are given a shorter one
+		this->savedEntries = 0;
+	}
+	std::vector<int> entries;
+	for (int i = this->savedEntries; i < delivered.size(); i++) {
+		entries.push_back(delivered[i].var[0]);
+		entries.push_back(delivered[i].val);
+		entries.push_back(delivered[i].ts);
+		entries.push_back(delivered[i].origin);
+		entries.push_back(delivered[i].seq);
+	}
+	if (!writeInts(this->path + ".log", (size_t)this->savedEntries * CHECKPOINT_ENTRY_INTS, entries)) {
+		std::cout << "[" << data.id << "]Could not map checkpoint file " << this->path << ".log\n";
+		return false;
+	}
+
+	// then the state, which says how many of the logged notifications count
+	std::vector<int> state{ CHECKPOINT_MAGIC, data.id, data.timestamp, data.currentSetOperation, data.ownSetOpen,
+		data.ownSetVar.empty() ? -1 : data.ownSetVar[0], data.ownSetFanOut, (int)delivered.size(), (int)data.variables.size(),
+		(int)data.frameworkOperations.size(), (int)data.receivedPrepares.size(), (int)data.prepareResponses.size() };
+	for (int i = 0; i < data.variables.size(); i++) {
+		state.insert(state.end(), { data.variables[i][0], data.values[i] });
+	}
+	for (auto fo : data.frameworkOperations) {
+		state.insert(state.end(), { fo.var[0], fo.val, fo.ts, fo.notified, fo.origin, fo.seq });
+	}
+	for (auto pr : data.receivedPrepares) {
+		state.insert(state.end(), { pr.var[0], pr.ts, pr.sender, pr.open });
+	}
+	for (auto pr : data.prepareResponses) {
+		state.insert(state.end(), { pr.var[0], pr.ts, pr.sender });
+	}
+	if (!writeInts(this->path, 0, state)) {
+		std::cout << "[" << data.id << "]Could not map checkpoint file " << this->path << '\n';
+		return false;
+	}
+
+	this->savedEntries = delivered.size();
+	return true;
+}
+
+bool Checkpoint::load(CheckpointData& data) {
+	std::vector<int> state, entries;
+	if (!readInts(this->path, state) || state.size() < CHECKPOINT_HEADER_INTS || state[0] != CHECKPOINT_MAGIC) {
+		return false;
+	}
+	int nr_delivered = state[7];
+	size_t needed = CHECKPOINT_HEADER_INTS + 2 * (size_t)state[8] + 6 * (size_t)state[9] + 4 * (size_t)state[10] + 3 * (size_t)state[11];
+	if (state.size() < needed) {
+		return false;
+	}
+	if (nr_delivered > 0 && (!readInts(this->path + ".log", entries) || entries.size() < (size_t)nr_delivered * CHECKPOINT_ENTRY_INTS)) {
+		return false;
+	}
+
+	data.id = state[1];
+	data.timestamp = state[2];
+	data.currentSetOperation = state[3];
+	data.ownSetOpen = state[4] != 0;
+	data.ownSetVar = state[5] == -1 ? "" : std::string(1, (char)state[5]);
+	data.ownSetFanOut = state[6];
+	const int* p = state.data() + CHECKPOINT_HEADER_INTS;
+	for (int i = 0; i < state[8]; i++, p += 2) {
+		data.variables.push_back(std::string(1, (char)p[0]));
+		data.values.push_back(p[1]);
+	}
+	for (int i = 0; i < state[9]; i++, p += 6) {
+		SetOperationFramework fo{ std::string(1, (char)p[0]), p[1], p[2] };
+		fo.notified = p[3] != 0;
+		fo.origin = p[4];
+		fo.seq = p[5];
+		data.frameworkOperations.push_back(fo);
+	}
+	for (int i = 0; i < state[10]; i++, p += 4) {
+		data.receivedPrepares.push_back(Prepare{ std::string(1, (char)p[0]), p[1], p[2], p[3] != 0 });
+	}
+	for (int i = 0; i < state[11]; i++, p += 3) {
+		data.prepareResponses.push_back(PrepareResponse{ std::string(1, (char)p[0]), p[1], p[2] });
+	}
+	data.delivered.resize(nr_delivered);
+	for (int i = 0; i < nr_delivered; i++) {
+		const int* e = entries.data() + (size_t)i * CHECKPOINT_ENTRY_INTS;
+		data.delivered[i] = SetOperationFramework{ std::string(1, (char)e[0]), e[1], e[2] };
+		data.delivered[i].origin = e[3];
+		data.delivered[i].seq = e[4];
+	}
+
+	// further saves append after what is already in the log file
+	this->savedEntries = nr_delivered;
+	return true;
+}
+
+std::string Checkpoint::getPath() {
+	return this->path;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "Process.h"
+
+// state of a process as saved in / read back from a checkpoint
+struct CheckpointData {
+	int id = -1;
+	int timestamp = 0;
+	int currentSetOperation = 0; // operations before this one are done and must not run again
+	bool ownSetOpen = false;
+	std::string ownSetVar;
+	int ownSetFanOut = 0;
+	std::vector<std::string> variables;
+	std::vector<int> values;
+	std::vector<SetOperationFramework> delivered; // filled by load; save gets them by reference, since they only grow
+	std::vector<SetOperationFramework> frameworkOperations;
+	std::vector<Prepare> receivedPrepares;
+	std::vector<PrepareResponse> prepareResponses;
+};
+
+/* A checkpoint is two files, both written through a memory mapping (all ints):
+* <path>: the state, rewritten by every save
+*   [magic, id, timestamp, currentSetOperation, ownSetOpen, ownSetVar, ownSetFanOut, nr_delivered,
+*    nr_variables, nr_framework, nr_prepares, nr_responses]
+*   [var, val] x nr_variables
+*   [var, val, ts, notified, origin, seq] x nr_framework
+*   [var, ts, sender, open] x nr_prepares
+*   [var, ts, sender] x nr_responses
+* <path>.log: [var, val, ts, origin, seq] for every delivered notification; a save only appends the
+*   ones delivered since the last save. Entries past nr_delivered (a save that did not
+*   finish) are ignored.
+*/
+const int CHECKPOINT_MAGIC = 0x4C384353;
+const int CHECKPOINT_HEADER_INTS = 12;
+const int CHECKPOINT_ENTRY_INTS = 5;
+
+class Checkpoint
+{
+private:
+	std::string path;
+	int savedEntries = 0; // delivered entries already written to the log file
+
+public:
+	Checkpoint(std::string path);
+	bool save(const CheckpointData& data, const std::vector<SetOperationFramework>& delivered);
+	bool load(CheckpointData& data);
+	std::string getPath();
+};
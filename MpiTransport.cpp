@@ -0,0 +1,62 @@
+#include "MpiTransport.h"
+#include <chrono>
+#include <thread>
+
+MpiTransport::MpiTransport() {
+	MPI_Comm_rank(MPI_COMM_WORLD, &this->rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &this->size);
+}
+
+int MpiTransport::getRank() {
+	return this->rank;
+}
+
+int MpiTransport::getSize() {
+	return this->size;
+}
+
+void MpiTransport::sendMessage(int dest, const std::vector<int>& data) {
+	MPI_Send(data.data(), data.size(), MPI_INT, dest, 123, MPI_COMM_WORLD);
+}
+
+Message MpiTransport::receiveMessage(int source) {
+	// probe first so we know how big the message is
+	MPI_Status status;
+	MPI_Probe(source == ANY_SOURCE ? MPI_ANY_SOURCE : source, 123, MPI_COMM_WORLD, &status);
+	int count;
+	MPI_Get_count(&status, MPI_INT, &count);
+
+	Message message;
+	message.source = status.MPI_SOURCE;
+	message.data.resize(count);
+	MPI_Recv(message.data.data(), count, MPI_INT, status.MPI_SOURCE, 123, MPI_COMM_WORLD, &status);
+	return message;
+}
+
+bool MpiTransport::tryReceiveMessage(int source, long long timeoutMicros, Message& message) {
+	// poll until a message is there or the time is up
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutMicros);
+	MPI_Status status;
+	int flag = 0;
+	int idle = 0;
+	while (true) {
+		MPI_Iprobe(source == ANY_SOURCE ? MPI_ANY_SOURCE : source, 123, MPI_COMM_WORLD, &flag, &status);
+		if (flag) {
+			break;
+		}
+		if (std::chrono::steady_clock::now() >= deadline) {
+			return false;
+		}
+		// spin a little, then back off so we don't eat the CPU
+		idle++;
+		if (idle < 64) {
+			std::this_thread::yield();
+		}
+		else {
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+	// the probed message is the oldest one from its source, so this receives exactly it
+	message = this->receiveMessage(status.MPI_SOURCE);
+	return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <mpi.h>
+#include "Transport.h"
+
+// one node per MPI process; every message is sent with tag 123 on MPI_COMM_WORLD
+class MpiTransport : public Transport
+{
+private:
+	int rank;
+	int size;
+
+protected:
+	void sendMessage(int dest, const std::vector<int>& data) override;
+	Message receiveMessage(int source) override;
+	bool tryReceiveMessage(int source, long long timeoutMicros, Message& message) override;
+
+public:
+	MpiTransport();
+	int getRank() override;
+	int getSize() override;
+};
@@ -1,10 +1,41 @@
 #include "Process.h"
+#include "Checkpoint.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 
-Process::Process(int id) {
+static long long nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the log line of a delivered notification, e.g. NOTIFY(X,5) ts=4 id=1:0
+static std::string notifyLine(const SetOperationFramework& sof) {
+	return "NOTIFY(" + sof.var + "," + std::to_string(sof.val) + ") ts=" + std::to_string(sof.ts)
+		+ " id=" + std::to_string(sof.origin) + ":" + std::to_string(sof.seq);
+}
+
+// the order notifications are delivered in: by ts, then by origin and seq, so that
+// operations with the same ts are delivered in the same order everywhere
+static bool isDeliveredAfter(const SetOperationFramework& a, const SetOperationFramework& b) {
+	if (a.ts != b.ts) {
+		return a.ts > b.ts;
+	}
+	if (a.origin != b.origin) {
+		return a.origin > b.origin;
+	}
+	return a.seq > b.seq;
+}
+
+Process::Process(int id, Transport* transport) {
 	this->id = id;
+	this->transport = transport;
 }
 
 void Process::subscribeToVar(std::string var) {
+	if (this->getIndexForVariable(var) != -1) {
+		return;
+	}
+	this->variableIndex[var] = this->variables.size();
 	this->variables.push_back(var);
 	this->values.push_back(-1);
 }
@@ -29,29 +60,114 @@ void Process::displayLog() {
 	std::cout << "[... done]\n";
 }
 
+bool Process::saveLogs(std::string logPath, std::string memoryPath) {
+	// same lines as displayLog and displayMemory, so the runs can be checked offline
+	std::ofstream logFile(logPath);
+	std::ofstream memoryFile(memoryPath);
+	if (!logFile || !memoryFile) {
+		std::cout << "[" << this->id << "]Could not write logs to " << logPath << '\n';
+		return false;
+	}
+	for (auto& message : this->log) {
+		logFile << message << '\n';
+	}
+	for (int i = 0; i < this->variables.size(); i++) {
+		memoryFile << this->variables[i] << '=' << this->values[i] << '\n';
+	}
+	return true;
+}
+
 void Process::addSetOperation(std::string var, int val) {
 	SetOperation so{ var, val };
 	this->setOperations.push_back(so);
 }
 
+void Process::addSubscriptionOperation(std::string var, int type) {
+	SetOperation so{ var, -1, false, type };
+	this->setOperations.push_back(so);
+}
+
 SetOperation Process::runNextSetOperation() {
-	if (this->currentSetOperation < this->setOperations.size()) {
-		std::cout << "[" << this->id << "]Running SET(" << this->setOperations[this->currentSetOperation].var << "," << this->setOperations[this->currentSetOperation].val << ")\n";
+	while (this->currentSetOperation < this->setOperations.size()) {
+		SetOperation so = this->setOperations[this->currentSetOperation];
 		this->currentSetOperation++;
-		return this->setOperations[this->currentSetOperation-1];
+		if (so.type == OP_SUBSCRIBE) {
+			std::cout << "[" << this->id << "]Running SUBSCRIBE(" << so.var << ")\n";
+		}
+		else if (so.type == OP_UNSUBSCRIBE) {
+			std::cout << "[" << this->id << "]Running UNSUBSCRIBE(" << so.var << ")\n";
+		}
+		else if (this->hasRunSetOperation()) {
+			// the prepare/triplet exchange orders a single SET per process
+			std::cout << "[" << this->id << "]Skipping SET(" << so.var << "," << so.val << "), only one SET per run\n";
+			continue;
+		}
+		else {
+			std::cout << "[" << this->id << "]Running SET(" << so.var << "," << so.val << ")\n";
+			this->ownSetOpen = true;
+			this->ownSetVar = so.var;
+			// the prepares go to everyone subscribed right now; changes arriving meanwhile wait for this SET
+			this->ownSetFanOut = 0;
+			for (auto pid : this->getSubscribersForVariable(so.var)) {
+				if (pid != this->id) {
+					this->ownSetFanOut++;
+				}
+			}
+		}
+		return so;
 	}
 	return SetOperation{ "NONE", -1 };
 }
 
+int Process::getRunningOperationIndex() {
+	return this->currentSetOperation - 1;
+}
+
+bool Process::hasRunSetOperation() {
+	// the operation that just ran does not count
+	for (int i = 0; i < this->currentSetOperation - 1; i++) {
+		if (this->setOperations[i].type == OP_SET) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Process::canRunNextOperation() {
+	return this->currentSetOperation < this->setOperations.size() && !this->ownSetOpen && this->awaitedReplies == 0;
+}
+
+bool Process::isIdle() {
+	// nothing to do until another message arrives
+	return !this->canRunNextOperation() && this->batch.empty();
+}
+
+void Process::expectReplies(int count) {
+	this->awaitedReplies += count;
+}
+
+void Process::receivedReply() {
+	if (this->awaitedReplies > 0) {
+		this->awaitedReplies--;
+	}
+}
+
 void Process::incrementTs() {
 	this->timestamp++;
 }
 
 void Process::addOtherSubscriber(std::string var, int pid) {
-	this->processesSubscribed[var].push_back(pid);
+	std::vector<int>& pids = this->processesSubscribed[var];
+	if (std::find(pids.begin(), pids.end(), pid) == pids.end()) {
+		pids.push_back(pid);
+	}
 }
 
 void Process::storeReceivedPrepare(std::string var, int ts, int sender) {
+	if (this->getIndexForVariable(var) == -1) {
+		// we left the variable; the sender still gets its response, but we wait for nothing
+		return;
+	}
 	Prepare p{ var, ts, sender, true };
 	this->receivedPrepares.push_back(p);
 }
@@ -62,83 +178,47 @@ void Process::storeReceivedPrepareResponse(std::string var, int ts, int sender)
 }
 
 bool Process::receivedAllPrepareResponses(std::string var) {
-	// all prepare messages should've been received
-	return this->prepareResponses.size() == this->getSubscribersForVariable(var).size();
+	// all prepare messages should've been received; counted against the subscribers the prepares went to
+	int count = 0;
+	for (auto pr : this->prepareResponses) {
+		if (pr.var == var) {
+			count++;
+		}
+	}
+	return count == this->ownSetFanOut;
 }
 
 void Process::sendTriplets(int my_rank) {
-	// go over the prepare responses and send the triplets
-	std::vector<Triplet> triplets;
-
-	std::string var;
-	int val, ts;
-	for (auto pr : this->prepareResponses) {
-		Triplet triplet{ pr.var, this->setOperations[0].val, pr.ts, pr.sender };
-		triplets.push_back(triplet);
-	}
-
-	// sort triplets by ts
-	Triplet aux;
-	for (int i = 0; i < triplets.size(); i++) {
-		for (int j = i+1; j < triplets.size(); j++) {
-			if (triplets[i].ts > triplets[j].ts) {
-				aux = triplets[i];
-				triplets[i] = triplets[j];
-				triplets[j] = aux;
-			}
+	// every subscriber gets the final ts of our SET, the same for all of them: the largest
+	// ts proposed for it (see updateLocalSetOperationTimestamp). Nobody delivers it before it
+	// knows the final ts, so all subscribers deliver it at the same place
+	SetOperation& so = this->setOperations[this->currentSetOperation - 1];
+	int ts = this->timestamp;
+	for (auto& fo : this->frameworkOperations) {
+		if (fo.origin == this->id && fo.seq == this->getRunningOperationIndex()) {
+			ts = fo.ts;
 		}
 	}
+	// our next proposals come after it
+	this->setTs(std::max(ts, this->timestamp));
 
-	// send triplets if their ts is smaller than the open messages timestamps
 	int code_send = 10;
-	char variable;
-	SetOperationFramework sof;
-	for (auto triplet : triplets) {
-		// for each triplet
-		variable = triplet.var[0];
-		val = triplet.val;
-		ts = triplet.ts;
-		// condition here blocks - DEADLOCK
-		/*Explanation: before sending a triplet to another party,
-		* the operation to be sent must have a lower timestamp than
-		* any of the timestamps of the open prepare messages received.
-		* The issue is that there is always an open prepare message
-		* with a lower timestamp. In order to close that message we must receive
-		* a triplet from the third party (the one we are expecting), however
-		* that triplet never arrives since the other party has the same issue: it can't
-		* send the triplet because there is an open prepare message with a lower timestamp.
-		* To fix that one we must send the triplet from the current framework, but we are unable to
-		* do that. So this is an ugly deadlock.
-		* Solution: - force the first framework to send its value anyway (to break the deadlock)
-		*/
-		if(this->isTimestampSmallerThanOpenMessages(ts) || my_rank == 1){
-		//if (this->isTimestampSmallerThanOpenMessages(ts)) { // this would be ideal
-			// increment the ts
-			this->incrementTs();
-			ts = this->timestamp;
-			if (triplet.dest == my_rank) {
-				SetOperationFramework sof;
-				sof.var = variable;
-				sof.val = val;
-				sof.ts = ts;
-				this->addFrameworkOperation(sof);
-			}
-			else {
-				// send it
-				MPI_Send(&code_send, 1, MPI_INT, triplet.dest, 123, MPI_COMM_WORLD);
-				MPI_Send(&variable, 1, MPI_INT, triplet.dest, 123, MPI_COMM_WORLD);
-				MPI_Send(&val, 1, MPI_INT, triplet.dest, 123, MPI_COMM_WORLD);
-				MPI_Send(&ts, 1, MPI_INT, triplet.dest, 123, MPI_COMM_WORLD);
-			}
+	for (auto pr : this->prepareResponses) {
+		if (pr.var != so.var) {
+			continue;
 		}
-		else {
-			std::cout << "[" << my_rank << "]failed\n";
-			sof.var = variable;
-			sof.val = val;
-			sof.ts = ts;
-			this->addFailedToSend(sof, triplet.dest);
+		if (this->hasPendingUnsubscribe(pr.var, pr.sender)) {
+			// it left the variable after answering; it does not wait for the value anymore
+			continue;
 		}
+		this->transport->sendInt(pr.sender, code_send);
+		this->transport->sendInt(pr.sender, so.var[0]);
+		this->transport->sendInt(pr.sender, so.val);
+		this->transport->sendInt(pr.sender, ts);
+		this->transport->sendInt(pr.sender, my_rank);
+		this->transport->sendInt(pr.sender, this->getRunningOperationIndex());
 	}
+	this->ownSetOpen = false;
 }
 
 bool Process::findPrepareForMessage(std::string var, int ts, int sender) {
@@ -163,12 +243,11 @@ void Process::setTs(int ts) {
 }
 
 int Process::getIndexForVariable(std::string var) {
-	for (int i = 0; i < this->variables.size(); i++) {
-		if (this->variables[i] == var) {
-			return i;
-		}
+	auto it = this->variableIndex.find(var);
+	if (it == this->variableIndex.end()) {
+		return -1;
 	}
-	return -1;
+	return it->second;
 }
 
 std::vector<int> Process::getSubscribersForVariable(std::string var) {
@@ -183,116 +262,433 @@ void Process::setValueForVariable(std::string var, int val) {
 }
 
 void Process::addFrameworkOperation(SetOperationFramework sof) {
-	// add or update
-	int i = 0;
-	for (auto fo : this->frameworkOperations) {
-		if (fo.var == sof.var) {
-			this->frameworkOperations[i] = sof;
-			return;
+	// add or update; an operation is known by its id, since several may be held back for one variable
+	for (int i = 0; i < this->frameworkOperations.size(); i++) {
+		if (this->frameworkOperations[i].origin == sof.origin && this->frameworkOperations[i].seq == sof.seq) {
+			this->frameworkOperations.erase(this->frameworkOperations.begin() + i);
+			break;
 		}
-		i++;
 	}
-	this->frameworkOperations.push_back(sof);
+	// kept in delivery order, so nothing has to be sorted again when notifications are sent
+	auto position = std::upper_bound(this->frameworkOperations.begin(), this->frameworkOperations.end(), sof,
+		[](const SetOperationFramework& a, const SetOperationFramework& b) { return isDeliveredAfter(b, a); });
+	this->frameworkOperations.insert(position, sof);
 }
 
 void Process::sendNotificationsFromFramework() {
-	// go through prepare messages and take a look at those timestamps
-	SetOperationFramework sof;
-	for (int i = 0; i < this->frameworkOperations.size(); i++) {
-		sof = this->frameworkOperations[i];
-		for (auto pr : this->receivedPrepares) {
-			if (pr.var == sof.var) {
-				// compare the timestamps
-				if (pr.ts > sof.ts) {
-					this->frameworkOperations[i].ts = pr.ts;
-				}
+	// "send" notifications: the held back operations are sorted by their final ts, then by id,
+	// and the deliverable ones are a prefix of this order
+	for (auto& sof : this->frameworkOperations) {
+		if (sof.notified) {
+			continue;
+		}
+		if (!this->isDeliverable(sof)) {
+			break;
+		}
+		sof.notified = true;
+		if (this->getIndexForVariable(sof.var) == -1) {
+			// a variable we unsubscribed from while its SET was running
+			continue;
+		}
+		if (this->batch.empty()) {
+			this->batchStart = nowMicros();
+		}
+		this->batch.push_back(sof);
+		if (this->batch.size() >= this->maxBatchSize) {
+			this->flushNotifications();
+		}
+	}
+	this->flushNotificationsIfDue();
+}
+
+bool Process::isDeliverable(const SetOperationFramework& sof) {
+	// nothing still open may end up before it: an open prepare, or our own open SET,
+	// gets a final ts no smaller than the ts it has now
+	for (auto pr : this->receivedPrepares) {
+		if (pr.open && (pr.ts < sof.ts || (pr.ts == sof.ts && pr.sender <= sof.origin))) {
+			return false;
+		}
+	}
+	if (this->ownSetOpen) {
+		for (auto& fo : this->frameworkOperations) {
+			if (fo.origin == this->id && fo.seq == this->getRunningOperationIndex() && !isDeliveredAfter(fo, sof)) {
+				return false;
 			}
 		}
 	}
-	// sort them
-	SetOperationFramework aux;
-	for (int i = 0; i < this->frameworkOperations.size(); i++) {
-		for (int j = i+1; j < this->frameworkOperations.size(); j++) {
-			if (this->frameworkOperations[i].ts > this->frameworkOperations[j].ts) {
-				aux = this->frameworkOperations[i];
-				this->frameworkOperations[i] = this->frameworkOperations[j];
-				this->frameworkOperations[j] = aux;
+	return true;
+}
+
+void Process::closePrepare(std::string var, int sender) {
+	for (int i = 0; i < this->receivedPrepares.size(); i++) {
+		if (this->receivedPrepares[i].var == var && (sender == -1 || this->receivedPrepares[i].sender == sender)) {
+			this->receivedPrepares[i].open = false;
+		}
+	}
+}
+
+void Process::updateLocalSetOperationTimestamp() {
+	// the final ts of the current operation is the largest one proposed for it, ours included;
+	// the held back operations are sorted, so it is not always the first one
+	for (auto fo : this->frameworkOperations) {
+		if (fo.origin == this->id && fo.seq == this->getRunningOperationIndex()) {
+			for (auto pr : this->prepareResponses) {
+				if (pr.var == fo.var) {
+					fo.ts = std::max(fo.ts, pr.ts);
+				}
 			}
+			// a later ts moves it in the order
+			this->addFrameworkOperation(fo);
+			return;
 		}
 	}
+}
+
+void Process::enableCheckpoints(std::string path, int interval) {
+	if (this->checkpoint == nullptr) {
+		this->checkpoint = new Checkpoint(path);
+	}
+	this->checkpointInterval = std::max(interval, 1);
+}
 
-	// "send" notifications
-	for (auto sof : this->frameworkOperations) {
-		// set the value
-		this->setValueForVariable(sof.var, sof.val);
-		this->addLog("NOTIFY(" + sof.var + "," + std::to_string(sof.val) + ") ts=" + std::to_string(sof.ts));
+void Process::saveCheckpoint() {
+	if (this->checkpoint == nullptr) {
+		return;
 	}
+	CheckpointData data;
+	data.id = this->id;
+	data.timestamp = this->timestamp;
+	data.currentSetOperation = this->currentSetOperation;
+	data.ownSetOpen = this->ownSetOpen;
+	data.ownSetVar = this->ownSetVar;
+	data.ownSetFanOut = this->ownSetFanOut;
+	data.variables = this->variables;
+	data.values = this->values;
+	data.frameworkOperations = this->frameworkOperations;
+	data.receivedPrepares = this->receivedPrepares;
+	data.prepareResponses = this->prepareResponses;
+	this->checkpoint->save(data, this->delivered);
 }
 
-bool Process::receivedAllOperationsForPrepares() {
-	return this->receivedPrepares.size() == this->frameworkOperations.size() - 1;
+bool Process::loadCheckpoint(std::string path) {
+	// the operations and the subscribers come from node 0 as usual; everything else is restored
+	if (this->checkpoint == nullptr || this->checkpoint->getPath() != path) {
+		this->checkpoint = new Checkpoint(path);
+	}
+	CheckpointData data;
+	if (!this->checkpoint->load(data) || data.id != this->id) {
+		return false;
+	}
+	this->timestamp = std::max(this->timestamp, data.timestamp);
+	// operations that already ran are not run again
+	this->currentSetOperation = std::min(data.currentSetOperation, (int)this->setOperations.size());
+	this->ownSetOpen = data.ownSetOpen;
+	this->ownSetVar = data.ownSetVar;
+	this->ownSetFanOut = data.ownSetFanOut;
+	this->variables.clear();
+	this->values.clear();
+	this->variableIndex.clear();
+	for (int i = 0; i < data.variables.size(); i++) {
+		this->subscribeToVar(data.variables[i]);
+		this->setValueForVariable(data.variables[i], data.values[i]);
+	}
+	this->delivered.clear();
+	this->deliveredIndex.clear();
+	for (auto& sof : data.delivered) {
+		this->addDelivered(sof);
+	}
+	this->frameworkOperations = data.frameworkOperations;
+	this->receivedPrepares = data.receivedPrepares;
+	this->prepareResponses = data.prepareResponses;
+	this->log.clear();
+	for (auto sof : this->delivered) {
+		this->addLog(notifyLine(sof));
+	}
+	if (this->checkpointInterval == 0) {
+		this->checkpointInterval = 1;
+	}
+	std::cout << "[" << this->id << "]Loaded checkpoint with ts=" << this->timestamp << ", delivered=" << this->delivered.size()
+		<< ", next operation=" << this->currentSetOperation << "\n";
+	return true;
 }
 
-bool Process::isTimestampSmallerThanOpenMessages(int ts) {
-	for (auto pr : this->receivedPrepares) {
-		if (pr.open) {
-			if (ts > pr.ts) {
-				return false;
+std::unordered_map<int, std::vector<int>> Process::getRejoinRequests() {
+	// every variable is asked from a peer holding it; a peer already asked for
+	// another variable is preferred, so fewer peers are involved
+	// the cursor of a variable is the number of notifications we delivered for it:
+	// all its subscribers deliver the same sequence, so the peer sends the rest of its own
+	std::unordered_map<int, std::vector<int>> requests; // peer -> <var, delivered count> for each variable
+	for (auto var : this->variables) {
+		int peer = -1;
+		for (auto pid : this->processesSubscribed[var]) {
+			if (pid != this->id && (peer == -1 || requests.count(pid) > 0)) {
+				peer = pid;
 			}
 		}
+		if (peer == -1) {
+			continue;
+		}
+		requests[peer].push_back(var[0]);
+		requests[peer].push_back(this->deliveredIndex[var].size());
+	}
+	this->awaitedRejoinReplies = requests.size();
+	this->expectReplies(requests.size());
+	return requests;
+}
+
+std::vector<int> Process::getDeliveredAfter(const std::vector<int>& cursors) {
+	// only the missed suffix of each variable is visited, so the cost is that of the delta
+	std::vector<int> entries; // MISSED_ENTRY_INTS for each operation the requester missed
+	for (int i = 0; i + 1 < cursors.size(); i += 2) {
+		auto it = this->deliveredIndex.find(std::string(1, cursors[i]));
+		if (it == this->deliveredIndex.end()) {
+			continue;
+		}
+		const std::vector<int>& positions = it->second;
+		for (int k = std::max(cursors[i + 1], 0); k < positions.size(); k++) {
+			const SetOperationFramework& sof = this->delivered[positions[k]];
+			entries.push_back(sof.var[0]);
+			entries.push_back(sof.val);
+			entries.push_back(sof.ts);
+			entries.push_back(sof.origin);
+			entries.push_back(sof.seq);
+		}
+	}
+	return entries;
+}
+
+bool Process::storeRejoinReply(const std::vector<int>& entries) {
+	for (int i = 0; i + MISSED_ENTRY_INTS <= entries.size(); i += MISSED_ENTRY_INTS) {
+		SetOperationFramework sof{ std::string(1, entries[i]), entries[i + 1], entries[i + 2] };
+		sof.origin = entries[i + 3];
+		sof.seq = entries[i + 4];
+		this->missed.push_back(sof);
+	}
+	this->receivedReply();
+	if (--this->awaitedRejoinReplies > 0) {
+		return false;
+	}
+	// every peer answered; apply what they sent in ts order
+	std::stable_sort(this->missed.begin(), this->missed.end(),
+		[](const SetOperationFramework& a, const SetOperationFramework& b) { return a.ts < b.ts; });
+	for (auto sof : this->missed) {
+		this->applyMissedOperation(sof);
 	}
+	this->missed.clear();
 	return true;
 }
 
-void Process::closePrepare(std::string var) {
-	for (int i = 0; i < this->receivedPrepares.size(); i++) {
-		if (this->receivedPrepares[i].var == var) {
-			this->receivedPrepares[i].open = false;
+void Process::applyMissedOperation(SetOperationFramework sof) {
+	if (this->getIndexForVariable(sof.var) == -1) {
+		// a variable we are not subscribed to
+		return;
+	}
+	// the same operation still waiting in the framework was just delivered by the peer
+	for (auto& fo : this->frameworkOperations) {
+		if (fo.origin == sof.origin && fo.seq == sof.seq) {
+			fo.notified = true;
 		}
 	}
+	this->setTs(std::max(sof.ts, this->timestamp));
+	this->setValueForVariable(sof.var, sof.val);
+	this->addLog(notifyLine(sof));
+	this->addDelivered(sof);
 }
 
-void Process::addFailedToSend(SetOperationFramework sof, int parent) {
-	FailedSend fs{sof, parent};
-	this->failedToSend.push_back(fs);
+void Process::addDelivered(const SetOperationFramework& sof) {
+	this->deliveredIndex[sof.var].push_back(this->delivered.size());
+	this->delivered.push_back(sof);
 }
 
-void Process::retrySendingFailedTriplets() {
-	std::vector<FailedSend> stillFailed;
-	for (auto fs : this->failedToSend) {
-		if (this->isTimestampSmallerThanOpenMessages(fs.sof.ts)) {
-			this->incrementTs();
-			// take ts from the prepare message response
-			int ts = this->getTSFromReceivedPrepareResponse(fs.sof.var);
-			std::cout << "Retry success with ts=" << ts << ",var=" << fs.sof.var << "\n";
-			int code_send = 10;
-			char var = fs.sof.var[0];
-			int val = fs.sof.val;
-			MPI_Send(&code_send, 1, MPI_INT, fs.parent, 123, MPI_COMM_WORLD);
-			MPI_Send(&var, 1, MPI_INT, fs.parent, 123, MPI_COMM_WORLD);
-			MPI_Send(&val, 1, MPI_INT, fs.parent, 123, MPI_COMM_WORLD);
-			MPI_Send(&ts, 1, MPI_INT, fs.parent, 123, MPI_COMM_WORLD);
+void Process::unsubscribeFromVar(std::string var) {
+	int idx = this->getIndexForVariable(var);
+	if (idx != -1) {
+		// the batch may still hold notifications for var; deliver them while we hold it
+		// (the batch only keeps names, which are looked up at flush time and would be dropped)
+		this->flushNotifications();
+		// and stop waiting for SETs on it: we won't deliver them
+		this->closePrepare(var, -1);
+		this->variables.erase(this->variables.begin() + idx);
+		this->values.erase(this->values.begin() + idx);
+		this->variableIndex.erase(var);
+		for (int i = idx; i < this->variables.size(); i++) {
+			this->variableIndex[this->variables[i]] = i;
+		}
+	}
+}
+
+void Process::removeOtherSubscriber(std::string var, int pid) {
+	std::vector<int>& pids = this->processesSubscribed[var];
+	pids.erase(std::remove(pids.begin(), pids.end(), pid), pids.end());
+}
+
+void Process::setSubscribersForVariable(std::string var, std::vector<int> pids) {
+	pids.erase(std::remove(pids.begin(), pids.end(), this->id), pids.end());
+	this->processesSubscribed[var] = pids;
+}
+
+bool Process::hasOpenPrepare(std::string var) {
+	if (this->ownSetOpen && this->ownSetVar == var) {
+		return true;
+	}
+	for (auto pr : this->receivedPrepares) {
+		if (pr.open && pr.var == var) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Process::hasUndeliveredSet(std::string var) {
+	// a SET on var that is open here, or closed but not yet handed to the app
+	if (this->hasOpenPrepare(var)) {
+		return true;
+	}
+	for (auto& sof : this->frameworkOperations) {
+		if (!sof.notified && sof.var == var) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Process::hasPendingUnsubscribe(std::string var, int pid) {
+	for (auto sc : this->pendingSubscriptionChanges) {
+		if (sc.var == var && sc.pid == pid && sc.type == OP_UNSUBSCRIBE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Process::storeSubscriptionChange(std::string var, int pid, int type, int ts) {
+	SubscriptionChange sc{ var, pid, type, ts };
+	this->pendingSubscriptionChanges.push_back(sc);
+}
+
+void Process::applySubscriptionChanges() {
+	// a change on a variable waits until every SET on it that this node knows of
+	// has been delivered, so the snapshot of a joiner already holds their values
+	std::sort(this->pendingSubscriptionChanges.begin(), this->pendingSubscriptionChanges.end(),
+		[](const SubscriptionChange& a, const SubscriptionChange& b) { return a.ts < b.ts; });
+	std::vector<SubscriptionChange> stillPending;
+	for (auto sc : this->pendingSubscriptionChanges) {
+		if (this->hasUndeliveredSet(sc.var)) {
+			stillPending.push_back(sc);
+			continue;
+		}
+		// every change is answered once it is applied: the joiner gets a snapshot from
+		// one subscriber and an ack from the others, the leaver an ack from everyone
+		bool sponsor = sc.type == OP_SUBSCRIBE && this->isSnapshotSponsor(sc.var, sc.pid);
+		if (sc.type == OP_UNSUBSCRIBE) {
+			this->removeOtherSubscriber(sc.var, sc.pid);
 		}
 		else {
-			stillFailed.push_back(fs);
+			this->addOtherSubscriber(sc.var, sc.pid);
+		}
+		if (!sponsor) {
+			int code_send = 16;
+			this->transport->sendInt(sc.pid, code_send);
+		}
+		else {
+			// send the new subscriber the current value and the subscribers it should fan out to;
+			// delivered notifications still in the batch are part of that value
+			this->flushNotifications();
+			this->incrementTs();
+			int code_send = 15;
+			int var = sc.var[0];
+			int val = this->values[this->getIndexForVariable(sc.var)];
+			int ts = this->timestamp;
+			std::vector<int> pids = this->processesSubscribed[sc.var];
+			pids.push_back(this->id);
+			this->transport->sendInt(sc.pid, code_send);
+			this->transport->sendInt(sc.pid, var);
+			this->transport->sendInt(sc.pid, val);
+			this->transport->sendInt(sc.pid, ts);
+			this->transport->send(sc.pid, pids);
 		}
 	}
-	this->failedToSend = stillFailed;
+	this->pendingSubscriptionChanges = stillPending;
 }
 
-int Process::getTSFromReceivedPrepareResponse(std::string var) {
-	for (auto pr : this->prepareResponses) {
-		if (var == pr.var) {
-			if (var == "X") { // the first one to break the deadlock
-				return pr.ts + 1;
-			}
-			return pr.ts;
+bool Process::isSnapshotSponsor(std::string var, int joiner) {
+	// only the subscriber with the smallest id answers, so the joiner gets exactly one snapshot
+	if (this->getIndexForVariable(var) == -1) {
+		return false;
+	}
+	for (auto pid : this->processesSubscribed[var]) {
+		if (pid != joiner && pid < this->id) {
+			return false;
 		}
 	}
-	return -1;
+	return true;
 }
 
-void Process::updateLocalSetOperationTimestamp() {
-	// current operation is always the first one since it was added at the beginning
-	this->frameworkOperations[0].ts = getTSFromReceivedPrepareResponse(this->frameworkOperations[0].var);
-}
\ No newline at end of file
+void Process::setBatching(int maxSize, long long maxDelayMicros) {
+	this->maxBatchSize = std::max(maxSize, 1);
+	this->maxBatchDelayMicros = maxDelayMicros;
+	this->batch.reserve(this->maxBatchSize);
+	this->batchIndexes.reserve(this->maxBatchSize);
+	this->batchValues.reserve(this->maxBatchSize);
+}
+
+void Process::setNotificationHandler(std::function<void(const SetOperationFramework*, int)> handler) {
+	this->notificationHandler = handler;
+}
+
+void Process::flushNotifications() {
+	int count = this->batch.size();
+	if (count == 0) {
+		return;
+	}
+
+	// look up every variable once, then apply all values in one pass over flat arrays;
+	// notifications for a variable we left meanwhile are dropped from the batch
+	this->batchIndexes.resize(count);
+	this->batchValues.resize(count);
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		int idx = this->getIndexForVariable(this->batch[i].var);
+		if (idx != -1) {
+			this->batchIndexes[kept] = idx;
+			this->batchValues[kept] = this->batch[i].val;
+			this->batch[kept] = this->batch[i];
+			kept++;
+		}
+	}
+	this->batch.resize(kept);
+	int* values = this->values.data();
+	const int* indexes = this->batchIndexes.data();
+	const int* newValues = this->batchValues.data();
+	for (int k = 0; k < kept; k++) {
+		values[indexes[k]] = newValues[k];
+	}
+
+	if (this->notificationHandler && kept > 0) {
+		this->notificationHandler(this->batch.data(), kept);
+	}
+	int checkpointsBefore = this->delivered.size() / std::max(this->checkpointInterval, 1);
+	for (auto sof : this->batch) {
+		this->addLog(notifyLine(sof));
+		this->addDelivered(sof);
+	}
+	this->batch.clear();
+	// checkpoint once per batch, whenever it crossed a multiple of checkpointInterval
+	if (this->checkpoint != nullptr && this->delivered.size() / this->checkpointInterval > checkpointsBefore) {
+		this->saveCheckpoint();
+	}
+}
+
+long long Process::getMicrosUntilBatchDue() {
+	// -1 if there is nothing to deliver
+	if (this->batch.empty()) {
+		return -1;
+	}
+	return std::max(this->batchStart + this->maxBatchDelayMicros - nowMicros(), 0LL);
+}
+
+void Process::flushNotificationsIfDue() {
+	if (!this->batch.empty() && nowMicros() - this->batchStart >= this->maxBatchDelayMicros) {
+		this->flushNotifications();
+	}
+}
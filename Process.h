@@ -1,9 +1,10 @@
 #pragma once
-#include <mpi.h>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <functional>
+#include "Transport.h"
 
 struct Prepare {
 	std::string var;
@@ -18,55 +19,94 @@ struct PrepareResponse {
 	int sender;
 };
 
+// kinds of operations the app can ask the framework for
+enum OperationType {
+	OP_SET = 0,
+	OP_SUBSCRIBE = 1,
+	OP_UNSUBSCRIBE = 2
+};
+
 struct SetOperation {
 	std::string var;
 	int val;
 	bool open = false;
+	int type = OP_SET;
 };
 
-// stores a set operation on the framework level
-struct SetOperationFramework {
+// a subscribe/unsubscribe received from another framework; applied once no SET on var is open
+struct SubscriptionChange {
 	std::string var;
-	int val;
+	int pid;
+	int type; // OP_SUBSCRIBE or OP_UNSUBSCRIBE
 	int ts;
 };
 
-struct FailedSend {
-	SetOperationFramework sof;
-	int parent;
-};
-
-struct Triplet {
+// stores a set operation on the framework level
+struct SetOperationFramework {
 	std::string var;
 	int val;
 	int ts;
-	int dest;
+	bool notified = false; // already handed to the app; never delivered twice
+	int origin = -1; // the operation is the seq-th one of process origin; the same on every node, unlike ts
+	int seq = -1;
 };
 
+class Checkpoint;
+
+// a missed operation sent to a rejoining process: <var, val, ts, origin, seq>
+const int MISSED_ENTRY_INTS = 5;
+
 class Process
 {
 private:
 	int id;
+	Transport* transport;
 	int timestamp = 0;
 	std::vector<std::string> variables;
 	std::unordered_map<std::string, std::vector<int>> processesSubscribed; // for each variable, vector of ids of subscribed processes
 	std::vector<int> values; // associated to variables
+	std::unordered_map<std::string, int> variableIndex; // position of each variable in variables/values
 	std::vector<std::string> log; // contains operations so we know the order they were received in; should be the same for all processes
 	std::vector<SetOperation> setOperations;
 	int currentSetOperation = 0;
+	bool ownSetOpen = false; // our SET is waiting for its prepare responses
+	std::string ownSetVar;
+	int ownSetFanOut = 0; // subscribers our SET sent prepares to; a subscription change later on does not change it
+	int awaitedReplies = 0; // replies we wait for before running the next operation
+	int awaitedRejoinReplies = 0; // ... of which from rejoin peers
+	std::vector<SetOperationFramework> missed; // operations received from rejoin peers, applied once all of them answered
 	std::vector<Prepare> receivedPrepares; // <var, ts, sender, index_operation>
 	std::vector<PrepareResponse> prepareResponses; // <index of set operation, vector of prepare responses>
 	std::vector<SetOperationFramework> frameworkOperations;
-	std::vector<FailedSend> failedToSend;
+	std::vector<SubscriptionChange> pendingSubscriptionChanges;
+	std::vector<SetOperationFramework> delivered; // notifications delivered to the app, in order; used to answer rejoin requests
+	std::unordered_map<std::string, std::vector<int>> deliveredIndex; // for each variable, positions in delivered of its notifications
+	Checkpoint* checkpoint = nullptr;
+	int checkpointInterval = 0; // save a checkpoint every checkpointInterval delivered notifications
+	std::vector<SetOperationFramework> batch; // deliverable notifications not yet handed to the app
+	std::vector<int> batchIndexes; // index in values of each notification in the batch
+	std::vector<int> batchValues;
+	long long batchStart = 0; // when the oldest notification in the batch became deliverable (us)
+	int maxBatchSize = 1; // deliver as soon as the batch has this many notifications
+	long long maxBatchDelayMicros = 0; // ... or its oldest notification waited this long
+	std::function<void(const SetOperationFramework*, int)> notificationHandler; // gets every batch, in ts order
 
 public:
-	Process(int id);
+	Process(int id, Transport* transport);
 	void subscribeToVar(std::string var);
 	void displayMemory();
 	void addLog(std::string message);
 	void displayLog();
+	bool saveLogs(std::string logPath, std::string memoryPath);
 	void addSetOperation(std::string var, int val);
+	void addSubscriptionOperation(std::string var, int type);
 	SetOperation runNextSetOperation();
+	int getRunningOperationIndex();
+	bool hasRunSetOperation();
+	bool canRunNextOperation();
+	bool isIdle();
+	void expectReplies(int count);
+	void receivedReply();
 	void incrementTs();
 	void addOtherSubscriber(std::string var, int pid);
 	void storeReceivedPrepare(std::string var, int ts, int sender);
@@ -83,12 +123,33 @@ public:
 	void setValueForVariable(std::string var, int val);
 	void addFrameworkOperation(SetOperationFramework sof);
 	void sendNotificationsFromFramework();
-	bool receivedAllOperationsForPrepares();
-	bool isTimestampSmallerThanOpenMessages(int ts);
-	void closePrepare(std::string var);
-	void addFailedToSend(SetOperationFramework sof, int parent);
-	void retrySendingFailedTriplets();
-	int getTSFromReceivedPrepareResponse(std::string var);
+	bool isDeliverable(const SetOperationFramework& sof);
+	void closePrepare(std::string var, int sender);
 	void updateLocalSetOperationTimestamp();
+
+	void enableCheckpoints(std::string path, int interval);
+	void saveCheckpoint();
+	bool loadCheckpoint(std::string path);
+	std::unordered_map<int, std::vector<int>> getRejoinRequests();
+	std::vector<int> getDeliveredAfter(const std::vector<int>& cursors);
+	bool storeRejoinReply(const std::vector<int>& entries);
+	void applyMissedOperation(SetOperationFramework sof);
+	void addDelivered(const SetOperationFramework& sof);
+
+	void unsubscribeFromVar(std::string var);
+	void removeOtherSubscriber(std::string var, int pid);
+	void setSubscribersForVariable(std::string var, std::vector<int> pids);
+	bool hasOpenPrepare(std::string var);
+	bool hasUndeliveredSet(std::string var);
+	bool hasPendingUnsubscribe(std::string var, int pid);
+	void storeSubscriptionChange(std::string var, int pid, int type, int ts);
+	void applySubscriptionChanges();
+	bool isSnapshotSponsor(std::string var, int joiner);
+
+	void setBatching(int maxSize, long long maxDelayMicros);
+	void setNotificationHandler(std::function<void(const SetOperationFramework*, int)> handler);
+	void flushNotifications();
+	void flushNotificationsIfDue();
+	long long getMicrosUntilBatchDue();
 };
 
@@ -0,0 +1,158 @@
+#include "ThreadTransport.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+Mailbox::Mailbox() {
+	this->stub.next.store(nullptr);
+	this->head.store(&this->stub);
+	this->tail = &this->stub;
+}
+
+Mailbox::~Mailbox() {
+	MailboxNode* node;
+	while ((node = this->pop()) != nullptr) {
+		delete node;
+	}
+}
+
+void Mailbox::push(MailboxNode* node) {
+	node->next.store(nullptr, std::memory_order_relaxed);
+	MailboxNode* prev = this->head.exchange(node, std::memory_order_acq_rel);
+	prev->next.store(node, std::memory_order_release);
+}
+
+MailboxNode* Mailbox::pop() {
+	MailboxNode* tail = this->tail;
+	MailboxNode* next = tail->next.load(std::memory_order_acquire);
+	if (tail == &this->stub) {
+		if (next == nullptr) {
+			return nullptr;
+		}
+		// skip over the stub
+		this->tail = next;
+		tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next != nullptr) {
+		this->tail = next;
+		return tail;
+	}
+	if (tail != this->head.load(std::memory_order_acquire)) {
+		// a sender swapped the head but did not link its node yet
+		return nullptr;
+	}
+	// tail is the last node; put the stub behind it so it can be taken out
+	this->push(&this->stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next != nullptr) {
+		this->tail = next;
+		return tail;
+	}
+	return nullptr;
+}
+
+ThreadNetwork::ThreadNetwork(int size, int maxLatencyMicros, bool reorder) : mailboxes(size) {
+	this->size = size;
+	this->maxLatencyMicros = maxLatencyMicros;
+	this->reorder = reorder;
+	if (maxLatencyMicros > 0) {
+		this->lastDeliverAt.resize((size_t)size * size, 0);
+	}
+}
+
+int ThreadNetwork::getSize() {
+	return this->size;
+}
+
+long long ThreadNetwork::now() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ThreadNetwork::deliver(int source, int dest, const std::vector<int>& data) {
+	MailboxNode* node = new MailboxNode();
+	node->message.source = source;
+	node->message.data = data;
+	if (this->maxLatencyMicros > 0) {
+		long long delay = this->maxLatencyMicros;
+		if (this->reorder) {
+			thread_local std::mt19937 generator(std::random_device{}());
+			delay = std::uniform_int_distribution<long long>(0, this->maxLatencyMicros)(generator);
+		}
+		// never let a message overtake an earlier one between the same two nodes
+		long long& last = this->lastDeliverAt[(size_t)source * this->size + dest];
+		node->deliverAt = std::max(this->now() + delay, last);
+		last = node->deliverAt;
+	}
+	this->mailboxes[dest].push(node);
+}
+
+Mailbox& ThreadNetwork::getMailbox(int rank) {
+	return this->mailboxes[rank];
+}
+
+ThreadTransport::ThreadTransport(ThreadNetwork* network, int rank) {
+	this->network = network;
+	this->rank = rank;
+}
+
+ThreadTransport::~ThreadTransport() {
+	for (auto node : this->pending) {
+		delete node;
+	}
+}
+
+int ThreadTransport::getRank() {
+	return this->rank;
+}
+
+int ThreadTransport::getSize() {
+	return this->network->getSize();
+}
+
+void ThreadTransport::sendMessage(int dest, const std::vector<int>& data) {
+	this->network->deliver(this->rank, dest, data);
+}
+
+Message ThreadTransport::receiveMessage(int source) {
+	Message message;
+	this->tryReceiveMessage(source, -1, message);
+	return message;
+}
+
+bool ThreadTransport::tryReceiveMessage(int source, long long timeoutMicros, Message& message) {
+	// a negative timeout waits forever
+	Mailbox& mailbox = this->network->getMailbox(this->rank);
+	long long deadline = this->network->now() + timeoutMicros;
+	int idle = 0;
+	while (true) {
+		MailboxNode* node;
+		while ((node = mailbox.pop()) != nullptr) {
+			this->pending.push_back(node);
+		}
+		// delivery times only grow between two nodes, so the first ready
+		// message from a source is also the oldest one from that source
+		long long now = this->network->now();
+		for (auto it = this->pending.begin(); it != this->pending.end(); it++) {
+			if ((source == ANY_SOURCE || (*it)->message.source == source) && (*it)->deliverAt <= now) {
+				node = *it;
+				this->pending.erase(it);
+				message = std::move(node->message);
+				delete node;
+				return true;
+			}
+		}
+		if (timeoutMicros >= 0 && now >= deadline) {
+			return false;
+		}
+		// nothing yet; spin a little, then back off so idle nodes don't eat the CPU
+		idle++;
+		if (idle < 64) {
+			std::this_thread::yield();
+		}
+		else {
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "Transport.h"
+
+struct MailboxNode {
+	std::atomic<MailboxNode*> next;
+	Message message;
+	long long deliverAt = 0; // microseconds on the network clock
+};
+
+// lock-free queue with many senders and one receiver (Vyukov's intrusive MPSC queue)
+class Mailbox
+{
+private:
+	std::atomic<MailboxNode*> head; // senders push here
+	MailboxNode* tail; // only touched by the receiver
+	MailboxNode stub;
+
+public:
+	Mailbox();
+	~Mailbox();
+	void push(MailboxNode* node);
+	MailboxNode* pop(); // nullptr if empty (or a sender is halfway through a push)
+};
+
+// many logical nodes running as threads of the same process
+class ThreadNetwork
+{
+private:
+	int size;
+	int maxLatencyMicros; // every message is delayed by up to this much
+	bool reorder; // random delays, so messages from different senders can overtake each other
+	std::vector<Mailbox> mailboxes;
+	std::vector<long long> lastDeliverAt; // [source * size + dest]; a row is only written by its source node
+
+public:
+	ThreadNetwork(int size, int maxLatencyMicros, bool reorder);
+	int getSize();
+	long long now();
+	void deliver(int source, int dest, const std::vector<int>& data);
+	Mailbox& getMailbox(int rank);
+};
+
+// the view of a ThreadNetwork from one of its nodes; must only be used by that node's thread
+class ThreadTransport : public Transport
+{
+private:
+	ThreadNetwork* network;
+	int rank;
+	std::deque<MailboxNode*> pending; // taken out of the mailbox but not received yet
+
+protected:
+	void sendMessage(int dest, const std::vector<int>& data) override;
+	Message receiveMessage(int source) override;
+	bool tryReceiveMessage(int source, long long timeoutMicros, Message& message) override;
+
+public:
+	ThreadTransport(ThreadNetwork* network, int rank);
+	~ThreadTransport();
+	int getRank() override;
+	int getSize() override;
+};
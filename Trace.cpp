@@ -0,0 +1,228 @@
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// LEB128: 7 bits per byte, the high bit set on every byte but the last
+static void putVarint(std::vector<unsigned char>& out, unsigned long long value) {
+	while (value >= 0x80) {
+		out.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char)value);
+}
+
+static bool getVarint(const unsigned char*& p, const unsigned char* end, unsigned long long& value) {
+	value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char byte = *p++;
+		value |= (unsigned long long)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// zigzag, so small negative ints (e.g. -1) stay short too
+static unsigned long long zigzag(int value) {
+	return ((unsigned long long)(unsigned int)value << 1) ^ (unsigned long long)(long long)(value >> 31);
+}
+
+static int unzigzag(unsigned long long value) {
+	return (int)((unsigned int)(value >> 1) ^ (0U - (unsigned int)(value & 1)));
+}
+
+TraceTransport::TraceTransport(Transport* inner, std::string path) {
+	this->inner = inner;
+	this->file.open(path, std::ios::binary | std::ios::trunc);
+	if (!this->file) {
+		std::cout << "[" << inner->getRank() << "]Could not open trace file " << path << '\n';
+	}
+	int header[3] = { TRACE_MAGIC, inner->getRank(), inner->getSize() };
+	this->file.write((const char*)header, sizeof(header));
+	this->file.flush();
+	this->buffer.reserve(TRACE_BUFFER_BYTES);
+	this->start = std::chrono::steady_clock::now();
+}
+
+TraceTransport::~TraceTransport() {
+	this->flush();
+}
+
+void TraceTransport::record(int kind, int peer, const std::vector<int>& data) {
+	long long time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start).count();
+	if (this->buffer.empty()) {
+		this->bufferedSince = time;
+	}
+	putVarint(this->buffer, time - this->lastTime);
+	putVarint(this->buffer, peer);
+	putVarint(this->buffer, (unsigned long long)data.size() << 1 | kind);
+	for (auto value : data) {
+		putVarint(this->buffer, zigzag(value));
+	}
+	this->lastTime = time;
+	// no write per message, which would distort the timings; but a run killed while busy loses little
+	if (this->buffer.size() >= TRACE_BUFFER_BYTES || time - this->bufferedSince >= TRACE_BUFFER_MICROS) {
+		this->flush();
+	}
+}
+
+void TraceTransport::flush() {
+	if (this->buffer.empty()) {
+		return;
+	}
+	this->file.write((const char*)this->buffer.data(), this->buffer.size());
+	this->file.flush();
+	this->buffer.clear();
+}
+
+int TraceTransport::getRank() {
+	return this->inner->getRank();
+}
+
+int TraceTransport::getSize() {
+	return this->inner->getSize();
+}
+
+void TraceTransport::sendMessage(int dest, const std::vector<int>& data) {
+	this->record(TRACE_OUT, dest, data);
+	this->inner->send(dest, data);
+}
+
+Message TraceTransport::receiveMessage(int source) {
+	Message message;
+	if (!this->inner->tryReceive(source, 0, message)) {
+		// the node waits: write out what it did so far, so a run that stalls here keeps its trace
+		this->flush();
+		message = this->inner->receive(source);
+	}
+	this->record(TRACE_IN, message.source, message.data);
+	return message;
+}
+
+bool TraceTransport::tryReceiveMessage(int source, long long timeoutMicros, Message& message) {
+	if (!this->inner->tryReceive(source, 0, message)) {
+		this->flush();
+		if (timeoutMicros == 0 || !this->inner->tryReceive(source, timeoutMicros, message)) {
+			return false;
+		}
+	}
+	this->record(TRACE_IN, message.source, message.data);
+	return true;
+}
+
+bool ReplayTransport::load(std::string path) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return false;
+	}
+	std::vector<unsigned char> trace((size_t)file.tellg());
+	file.seekg(0);
+	file.read((char*)trace.data(), trace.size());
+
+	int header[3];
+	if (trace.size() < sizeof(header)) {
+		return false;
+	}
+	std::memcpy(header, trace.data(), sizeof(header));
+	if (header[0] != TRACE_MAGIC) {
+		return false;
+	}
+	this->rank = header[1];
+	this->size = header[2];
+
+	// decode every record; a truncated one at the end is dropped
+	const unsigned char* p = trace.data() + sizeof(header);
+	const unsigned char* end = trace.data() + trace.size();
+	long long time = 0;
+	while (p < end) {
+		unsigned long long delta, peer, countKind, value;
+		if (!getVarint(p, end, delta) || !getVarint(p, end, peer) || !getVarint(p, end, countKind)) {
+			break;
+		}
+		TraceRecord record;
+		time += delta;
+		record.time = time;
+		record.peer = (int)peer;
+		record.kind = (int)(countKind & 1);
+		record.count = (int)(countKind >> 1);
+		record.data = this->ints.size();
+		bool complete = true;
+		for (int i = 0; i < record.count && complete; i++) {
+			complete = getVarint(p, end, value);
+			this->ints.push_back(unzigzag(value));
+		}
+		if (!complete) {
+			this->ints.resize(record.data);
+			break;
+		}
+		this->records.push_back(record);
+	}
+	return true;
+}
+
+bool ReplayTransport::nextRecord(size_t& position, int kind, TraceRecord& record) {
+	// skip the records of the other kind
+	while (position < this->records.size()) {
+		record = this->records[position++];
+		if (record.kind == kind) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int ReplayTransport::getRank() {
+	return this->rank;
+}
+
+int ReplayTransport::getSize() {
+	return this->size;
+}
+
+void ReplayTransport::sendMessage(int dest, const std::vector<int>& data) {
+	// nobody is listening; only check that the node still sends what it sent when it was traced
+	this->sent++;
+	TraceRecord record;
+	if (!this->nextRecord(this->outPosition, TRACE_OUT, record) || record.peer != dest
+		|| record.count != data.size() || !std::equal(data.begin(), data.end(), this->ints.begin() + record.data)) {
+		this->mismatches++;
+	}
+}
+
+Message ReplayTransport::receiveMessage(int source) {
+	TraceRecord record;
+	Message message;
+	if (!this->nextRecord(this->inPosition, TRACE_IN, record)) {
+		// the trace is over; -1 tells the worker to stop
+		message.source = source == ANY_SOURCE ? 0 : source;
+		message.data.push_back(-1);
+		return message;
+	}
+	if (source != ANY_SOURCE && source != record.peer) {
+		this->mismatches++;
+	}
+	this->received++;
+	message.source = record.peer;
+	message.data.assign(this->ints.begin() + record.data, this->ints.begin() + record.data + record.count);
+	return message;
+}
+
+bool ReplayTransport::tryReceiveMessage(int source, long long timeoutMicros, Message& message) {
+	// a replay never waits: the next message of the trace is always there
+	message = this->receiveMessage(source);
+	return true;
+}
+
+int ReplayTransport::getReceived() {
+	return this->received;
+}
+
+int ReplayTransport::getSent() {
+	return this->sent;
+}
+
+int ReplayTransport::getMismatches() {
+	return this->mismatches;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <chrono>
+#include <fstream>
+#include <string>
+#include "Transport.h"
+
+/* Trace file layout:
+* header: [magic, rank, size] (ints)
+* then one record per message, all fields as LEB128 varints:
+*   [microseconds since the previous record, peer, count << 1 | kind] then count zigzag-encoded ints
+* A single-int protocol message takes about 5 bytes.
+*/
+const int TRACE_MAGIC = 0x4C385453;
+const size_t TRACE_BUFFER_BYTES = 1 << 16; // records are written out once this much is buffered,
+const long long TRACE_BUFFER_MICROS = 100000; // ... the oldest buffered record is this old, or the node waits for a message
+
+enum TraceKind {
+	TRACE_OUT = 0, // sent by the traced node
+	TRACE_IN = 1 // received by the traced node
+};
+
+// a record as read back by a replay
+struct TraceRecord {
+	long long time; // microseconds since the trace was started
+	int kind;
+	int peer; // destination of an outbound message, source of an inbound one
+	int count;
+	size_t data; // index of its first int in ReplayTransport::ints
+};
+
+// records every message of another transport to a trace file
+class TraceTransport : public Transport
+{
+private:
+	Transport* inner;
+	std::ofstream file;
+	std::chrono::steady_clock::time_point start;
+	long long lastTime = 0; // of the last record, us since start
+	std::vector<unsigned char> buffer; // encoded records not written yet
+	long long bufferedSince = 0; // time of the oldest record in buffer
+
+	void record(int kind, int peer, const std::vector<int>& data);
+	void flush();
+
+protected:
+	void sendMessage(int dest, const std::vector<int>& data) override;
+	Message receiveMessage(int source) override;
+	bool tryReceiveMessage(int source, long long timeoutMicros, Message& message) override;
+
+public:
+	TraceTransport(Transport* inner, std::string path);
+	~TraceTransport();
+	int getRank() override;
+	int getSize() override;
+};
+
+// plays a trace back to one node, as fast as possible and without any other node
+class ReplayTransport : public Transport
+{
+private:
+	int rank = -1;
+	int size = 0;
+	std::vector<TraceRecord> records; // the whole trace, decoded
+	std::vector<int> ints; // the data of all records
+	size_t inPosition = 0; // next inbound record
+	size_t outPosition = 0; // next outbound record
+	int received = 0;
+	int sent = 0;
+	int mismatches = 0; // messages that differ from the ones in the trace
+
+	bool nextRecord(size_t& position, int kind, TraceRecord& record);
+
+protected:
+	void sendMessage(int dest, const std::vector<int>& data) override;
+	Message receiveMessage(int source) override;
+	bool tryReceiveMessage(int source, long long timeoutMicros, Message& message) override;
+
+public:
+	bool load(std::string path);
+	int getRank() override;
+	int getSize() override;
+	int getReceived();
+	int getSent();
+	int getMismatches();
+};
@@ -0,0 +1,46 @@
+#include "Transport.h"
+
+void Transport::send(int dest, const std::vector<int>& data) {
+	if (dest != 0 && this->getRank() != 0) {
+		this->peerSent++;
+	}
+	this->sendMessage(dest, data);
+}
+
+Message Transport::receive(int source) {
+	Message message = this->receiveMessage(source);
+	if (message.source != 0 && this->getRank() != 0) {
+		this->peerReceived++;
+	}
+	return message;
+}
+
+bool Transport::tryReceive(int source, long long timeoutMicros, Message& message) {
+	if (!this->tryReceiveMessage(source, timeoutMicros, message)) {
+		return false;
+	}
+	if (message.source != 0 && this->getRank() != 0) {
+		this->peerReceived++;
+	}
+	return true;
+}
+
+void Transport::sendInt(int dest, int value) {
+	this->send(dest, std::vector<int>{ value });
+}
+
+int Transport::receiveInt(int source, int* actualSource) {
+	Message message = this->receive(source);
+	if (actualSource != nullptr) {
+		*actualSource = message.source;
+	}
+	return message.data.empty() ? 0 : message.data[0];
+}
+
+long long Transport::getPeerSent() {
+	return this->peerSent;
+}
+
+long long Transport::getPeerReceived() {
+	return this->peerReceived;
+}
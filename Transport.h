@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+
+const int ANY_SOURCE = -1;
+
+// a message between two nodes
+struct Message {
+	int source;
+	std::vector<int> data;
+};
+
+// the way nodes talk to each other; messages sent from one node to another
+// are received in the order they were sent (like MPI)
+class Transport
+{
+private:
+	long long peerSent = 0; // messages exchanged with nodes other than 0 (which only coordinates the run)
+	long long peerReceived = 0;
+
+protected:
+	virtual void sendMessage(int dest, const std::vector<int>& data) = 0;
+	// blocks until a message from source (or from anyone, for ANY_SOURCE) arrives
+	virtual Message receiveMessage(int source) = 0;
+	// like receiveMessage, but gives up after timeoutMicros; false if nothing arrived in time
+	virtual bool tryReceiveMessage(int source, long long timeoutMicros, Message& message) = 0;
+
+public:
+	virtual ~Transport() {}
+	virtual int getRank() = 0;
+	virtual int getSize() = 0;
+
+	void send(int dest, const std::vector<int>& data);
+	Message receive(int source);
+	bool tryReceive(int source, long long timeoutMicros, Message& message);
+	void sendInt(int dest, int value);
+	int receiveInt(int source, int* actualSource = nullptr);
+	long long getPeerSent();
+	long long getPeerReceived();
+};
@@ -0,0 +1,287 @@
+#include "Verifier.h"
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// records kept in memory by all the sorters of one phase together
+const size_t VERIFY_MEMORY_RECORDS = 1 << 22;
+
+SpillFile::SpillFile() {
+	this->file = std::tmpfile();
+}
+
+SpillFile::~SpillFile() {
+	if (this->file != nullptr) {
+		std::fclose(this->file);
+	}
+}
+
+bool SpillFile::seek(long long offset) {
+#ifdef _WIN32
+	return _fseeki64(this->file, offset, SEEK_SET) == 0;
+#else
+	return fseeko(this->file, offset, SEEK_SET) == 0;
+#endif
+}
+
+long long SpillFile::reserve(long long bytes) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if (this->file == nullptr) {
+		return -1;
+	}
+	long long offset = this->end;
+	this->end += bytes;
+	return offset;
+}
+
+bool SpillFile::write(long long offset, const void* data, size_t bytes) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->file != nullptr && this->seek(offset) && std::fwrite(data, 1, bytes, this->file) == bytes;
+}
+
+bool SpillFile::read(long long offset, void* data, size_t bytes) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->file != nullptr && this->seek(offset) && std::fread(data, 1, bytes, this->file) == bytes;
+}
+
+// where a node delivered an operation
+struct IdPosition {
+	long long id;
+	long long position; // index among the notifications of the node
+};
+
+struct ByIdThenPosition {
+	bool operator()(const IdPosition& a, const IdPosition& b) const {
+		return a.id < b.id || (a.id == b.id && a.position < b.position);
+	}
+};
+
+// an operation delivered by node a (the owner of the sorter) and by node b
+struct SharedOperation {
+	long long positionA;
+	long long positionB;
+	long long id;
+	int b;
+};
+
+struct ByPositionA {
+	bool operator()(const SharedOperation& x, const SharedOperation& y) const {
+		return x.positionA < y.positionA || (x.positionA == y.positionA && x.b < y.b);
+	}
+};
+
+typedef ExternalSorter<IdPosition, ByIdThenPosition> IdSorter;
+typedef ExternalSorter<SharedOperation, ByPositionA> PairSorter;
+
+// parses "NOTIFY(X,5) ts=4 id=1:0"; other lines (e.g. SNAPSHOT) are not notifications
+static bool parseNotify(const std::string& line, LogEvent& event) {
+	if (line.compare(0, 7, "NOTIFY(") != 0 || line.size() < 9 || line[8] != ',') {
+		return false;
+	}
+	event.var = line[7];
+	size_t end = line.find(')', 9);
+	size_t ts = line.find("ts=", 9);
+	size_t id = line.find("id=", 9);
+	size_t colon = line.find(':', id == std::string::npos ? 9 : id);
+	if (end == std::string::npos || ts == std::string::npos || id == std::string::npos || colon == std::string::npos) {
+		return false;
+	}
+	event.val = std::atoi(line.c_str() + 9);
+	event.ts = std::atoi(line.c_str() + ts + 3);
+	event.id = ((long long)std::atoi(line.c_str() + id + 3) << 32) | (unsigned int)std::atoi(line.c_str() + colon + 1);
+	return true;
+}
+
+static std::string describe(long long id) {
+	return "operation " + std::to_string(id >> 32) + ":" + std::to_string((int)(id & 0xFFFFFFFF));
+}
+
+// runs work(node) for every node, on as many threads as the machine has
+static void forEachNode(int k, std::function<void(int)> work) {
+	std::atomic<int> next(0);
+	int nrThreads = std::max(1, std::min(k, (int)std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nrThreads; t++) {
+		threads.push_back(std::thread([&next, &work, k]() {
+			for (int node = next++; node < k; node = next++) {
+				work(node);
+			}
+		}));
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+int verifyLogs(std::string dir, int nodes) {
+	auto start = std::chrono::steady_clock::now();
+	int errors = 0;
+	std::mutex reportMutex;
+	auto report = [&errors, &reportMutex](std::string message) {
+		std::lock_guard<std::mutex> lock(reportMutex);
+		errors++;
+		if (errors <= 20) {
+			std::cout << "[verify]" << message << '\n';
+		}
+		else if (errors == 21) {
+			std::cout << "[verify]...\n";
+		}
+	};
+
+	// node 0 only sets things up, so the logs start at node 1; the last node is the one given,
+	// or else the highest one with a log or memory file
+	int lastRank = nodes - 1;
+	std::error_code error;
+	for (auto& entry : std::filesystem::directory_iterator(dir, error)) {
+		std::string name = entry.path().filename().string();
+		for (std::string prefix : { "log", "memory" }) {
+			if (nodes <= 0 && name.compare(0, prefix.size(), prefix) == 0 && name.size() > prefix.size() + 4
+				&& name.compare(name.size() - 4, 4, ".txt") == 0 && std::isdigit((unsigned char)name[prefix.size()])) {
+				lastRank = std::max(lastRank, std::atoi(name.c_str() + prefix.size()));
+			}
+		}
+	}
+	std::vector<int> ranks;
+	for (int rank = 1; rank <= lastRank; rank++) {
+		if (std::ifstream(dir + "/log" + std::to_string(rank) + ".txt").is_open()) {
+			ranks.push_back(rank);
+		}
+		else {
+			report("the log of node " + std::to_string(rank) + " is missing");
+		}
+	}
+	if (ranks.empty()) {
+		std::cout << "[verify]No logs found in " << dir << '\n';
+		return std::max(errors, 1);
+	}
+	int k = ranks.size();
+
+	// 1. every log, in parallel: <id, position> for each notification, sorted by id
+	std::unique_ptr<SpillFile> idSpill(new SpillFile());
+	std::vector<std::unique_ptr<IdSorter>> byId(k);
+	std::vector<long long> counts(k, 0);
+	for (int i = 0; i < k; i++) {
+		byId[i].reset(new IdSorter(idSpill.get(), std::max(VERIFY_MEMORY_RECORDS / k, (size_t)1024)));
+	}
+	forEachNode(k, [&](int i) {
+		std::ifstream file(dir + "/log" + std::to_string(ranks[i]) + ".txt");
+		std::string line;
+		LogEvent event;
+		while (std::getline(file, line)) {
+			if (parseNotify(line, event)) {
+				byId[i]->add(IdPosition{ event.id, counts[i]++ });
+			}
+		}
+		byId[i]->finish();
+	});
+	long long events = 0;
+	for (int i = 0; i < k; i++) {
+		events += counts[i];
+	}
+
+	// 2. k-way merge by id: the nodes that delivered an operation and where; every two of
+	// them give a pair of positions, filed under the smaller node
+	std::unique_ptr<SpillFile> pairSpill(new SpillFile());
+	std::vector<std::unique_ptr<PairSorter>> byPosition(k);
+	for (int i = 0; i < k; i++) {
+		byPosition[i].reset(new PairSorter(pairSpill.get(), std::max(VERIFY_MEMORY_RECORDS / k, (size_t)1024)));
+	}
+	std::vector<IdPosition> heads(k);
+	std::priority_queue<std::pair<long long, int>, std::vector<std::pair<long long, int>>, std::greater<std::pair<long long, int>>> heap; // <id, node>
+	for (int i = 0; i < k; i++) {
+		if (byId[i]->next(heads[i])) {
+			heap.push({ heads[i].id, i });
+		}
+	}
+	std::vector<std::pair<int, long long>> holders; // <node, position> for the current id, by node
+	while (!heap.empty()) {
+		long long id = heap.top().first;
+		holders.clear();
+		while (!heap.empty() && heap.top().first == id) {
+			int i = heap.top().second;
+			heap.pop();
+			holders.push_back({ i, heads[i].position });
+			bool more;
+			while ((more = byId[i]->next(heads[i])) && heads[i].id == id) {
+				report("node " + std::to_string(ranks[i]) + " delivers " + describe(id) + " more than once");
+			}
+			if (more) {
+				heap.push({ heads[i].id, i });
+			}
+		}
+		std::sort(holders.begin(), holders.end());
+		for (int x = 0; x < holders.size(); x++) {
+			for (int y = x + 1; y < holders.size(); y++) {
+				byPosition[holders[x].first]->add(SharedOperation{ holders[x].second, holders[y].second, id, holders[y].first });
+			}
+		}
+	}
+	for (int i = 0; i < k; i++) {
+		if (byId[i]->hasFailed()) {
+			report("could not sort the log of node " + std::to_string(ranks[i]) + " (temporary files)");
+		}
+		byId[i].reset();
+	}
+	idSpill.reset();
+
+	// 3. every node a, in parallel: walking the operations in a's order, the positions on
+	// every other node b must grow too, otherwise a and b disagree on the order
+	forEachNode(k, [&](int a) {
+		PairSorter& sorter = *byPosition[a];
+		sorter.finish();
+		std::vector<long long> lastPosition(k, -1);
+		std::vector<long long> lastId(k, 0);
+		std::vector<bool> reported(k, false);
+		SharedOperation shared;
+		while (sorter.next(shared)) {
+			int b = shared.b;
+			if (shared.positionB < lastPosition[b] && !reported[b]) {
+				// one report per pair of nodes is enough
+				reported[b] = true;
+				report("nodes " + std::to_string(ranks[a]) + " and " + std::to_string(ranks[b]) + " deliver "
+					+ describe(lastId[b]) + " and " + describe(shared.id) + " in a different order");
+			}
+			lastPosition[b] = shared.positionB;
+			lastId[b] = shared.id;
+		}
+		if (sorter.hasFailed()) {
+			report("could not sort the shared operations of node " + std::to_string(ranks[a]) + " (temporary files)");
+		}
+	});
+	byPosition.clear();
+	pairSpill.reset();
+
+	// final memory: the same value for a variable on every node subscribed to it
+	std::map<std::string, std::pair<std::string, int>> finalValues; // var -> <value, node>
+	for (auto rank : ranks) {
+		std::ifstream memory(dir + "/memory" + std::to_string(rank) + ".txt");
+		std::string line;
+		while (std::getline(memory, line)) {
+			size_t eq = line.find('=');
+			if (eq == std::string::npos) {
+				continue;
+			}
+			std::string var = line.substr(0, eq);
+			std::string value = line.substr(eq + 1);
+			auto it = finalValues.find(var);
+			if (it == finalValues.end()) {
+				finalValues[var] = { value, rank };
+			}
+			else if (it->second.first != value) {
+				report(var + " is " + it->second.first + " on node " + std::to_string(it->second.second) + " but " + value + " on node " + std::to_string(rank));
+			}
+		}
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "[verify]" << ranks.size() << " nodes, " << events << " notifications, " << errors << " problems, " << elapsed << "ms\n";
+	return errors;
+}
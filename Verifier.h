@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+// one NOTIFY line of a log
+struct LogEvent {
+	int var;
+	int val;
+	int ts; // local to the node that logged it; not comparable between nodes
+	long long id; // origin << 32 | seq; the same operation has the same id on every node
+};
+
+// a temporary file shared by all the sorters of one phase; every run is a range of it, so
+// the number of open files does not grow with the number of nodes or runs
+class SpillFile
+{
+private:
+	FILE* file;
+	std::mutex mutex;
+	long long end = 0;
+
+	bool seek(long long offset);
+
+public:
+	SpillFile();
+	~SpillFile();
+	SpillFile(const SpillFile&) = delete;
+	SpillFile& operator=(const SpillFile&) = delete;
+
+	// room for bytes at the end of the file; -1 if there is no file
+	long long reserve(long long bytes);
+	bool write(long long offset, const void* data, size_t bytes);
+	bool read(long long offset, void* data, size_t bytes);
+};
+
+// sorts more records than fit in memory: full runs are sorted and spilled to a SpillFile.
+// Every fanIn runs of one size are merged into a bigger one, so at most fanIn runs (one block
+// of each) are ever merged at once, however many records there are
+template <typename T, typename Less>
+class ExternalSorter
+{
+private:
+	struct Run {
+		long long offset; // in the spill file
+		size_t count;
+		int level; // 0 for a spilled buffer, level + 1 when merged from runs of level
+	};
+	// a run being read back, one block at a time
+	struct Reader {
+		Run run;
+		size_t read = 0; // records taken from the file so far
+		std::vector<T> block;
+		size_t position = 0;
+	};
+	struct Greater {
+		bool operator()(const std::pair<T, int>& a, const std::pair<T, int>& b) const {
+			return Less()(b.first, a.first);
+		}
+	};
+	typedef std::priority_queue<std::pair<T, int>, std::vector<std::pair<T, int>>, Greater> Heap; // <next record, reader>
+
+	SpillFile* spillFile;
+	size_t runSize;
+	size_t fanIn;
+	size_t blockRecords;
+	std::vector<T> buffer; // the run being filled; read out directly if nothing was spilled
+	size_t position = 0;
+	std::vector<Run> runs; // by level, highest first
+	std::vector<Reader> readers; // the runs read out by next
+	Heap heap;
+	bool failed = false;
+
+	bool refill(Reader& reader) {
+		size_t n = std::min(this->blockRecords, reader.run.count - reader.read);
+		reader.block.resize(n);
+		reader.position = 0;
+		if (n == 0) {
+			return false;
+		}
+		if (!this->spillFile->read(reader.run.offset + (long long)(reader.read * sizeof(T)), reader.block.data(), n * sizeof(T))) {
+			this->failed = true;
+			reader.block.clear();
+			return false;
+		}
+		reader.read += n;
+		return true;
+	}
+
+	void startMerge(std::vector<Reader>& readers, Heap& heap) {
+		for (int i = 0; i < readers.size(); i++) {
+			if (this->refill(readers[i])) {
+				heap.push({ readers[i].block[0], i });
+			}
+		}
+	}
+
+	bool takeNext(std::vector<Reader>& readers, Heap& heap, T& record) {
+		if (heap.empty()) {
+			return false;
+		}
+		int i = heap.top().second;
+		record = heap.top().first;
+		heap.pop();
+		Reader& reader = readers[i];
+		reader.position++;
+		if (reader.position < reader.block.size() || this->refill(reader)) {
+			heap.push({ reader.block[reader.position], i });
+		}
+		return true;
+	}
+
+	// merges the last n runs into one
+	void mergeLast(size_t n) {
+		std::vector<Reader> merging;
+		Run merged{ 0, 0, 0 };
+		for (size_t i = this->runs.size() - n; i < this->runs.size(); i++) {
+			merged.count += this->runs[i].count;
+			merged.level = std::max(merged.level, this->runs[i].level + 1);
+			merging.push_back(Reader{ this->runs[i] });
+		}
+		this->runs.resize(this->runs.size() - n);
+		merged.offset = this->spillFile->reserve((long long)(merged.count * sizeof(T)));
+		if (merged.offset < 0) {
+			this->failed = true;
+			return;
+		}
+		Heap merge;
+		this->startMerge(merging, merge);
+		std::vector<T> out;
+		out.reserve(this->blockRecords);
+		long long written = merged.offset;
+		T record;
+		while (this->takeNext(merging, merge, record)) {
+			out.push_back(record);
+			if (out.size() == this->blockRecords || merge.empty()) {
+				if (!this->spillFile->write(written, out.data(), out.size() * sizeof(T))) {
+					this->failed = true;
+				}
+				written += out.size() * sizeof(T);
+				out.clear();
+			}
+		}
+		this->runs.push_back(merged);
+	}
+
+	void spill() {
+		std::sort(this->buffer.begin(), this->buffer.end(), Less());
+		Run run{ this->spillFile->reserve((long long)(this->buffer.size() * sizeof(T))), this->buffer.size(), 0 };
+		if (run.offset < 0 || !this->spillFile->write(run.offset, this->buffer.data(), this->buffer.size() * sizeof(T))) {
+			this->failed = true;
+			this->buffer.clear();
+			return;
+		}
+		this->buffer.clear();
+		this->runs.push_back(run);
+		// like a counter: fanIn runs of one level carry over into one run of the next level
+		while (this->runs.size() >= this->fanIn && this->runs[this->runs.size() - this->fanIn].level == this->runs.back().level) {
+			this->mergeLast(this->fanIn);
+		}
+	}
+
+public:
+	ExternalSorter(SpillFile* spillFile, size_t runSize, size_t fanIn = 16) {
+		this->spillFile = spillFile;
+		this->runSize = std::max(runSize, (size_t)1);
+		this->fanIn = std::max(fanIn, (size_t)2);
+		// merging fanIn runs holds about as many records as one run
+		this->blockRecords = std::max(this->runSize / this->fanIn, (size_t)64);
+	}
+
+	ExternalSorter(const ExternalSorter&) = delete;
+	ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+	void add(const T& record) {
+		if (this->buffer.capacity() == 0) {
+			this->buffer.reserve(this->runSize);
+		}
+		this->buffer.push_back(record);
+		if (this->buffer.size() == this->runSize) {
+			this->spill();
+		}
+	}
+
+	// no more records will be added; call before next
+	void finish() {
+		if (this->runs.empty()) {
+			std::sort(this->buffer.begin(), this->buffer.end(), Less());
+			return;
+		}
+		if (!this->buffer.empty()) {
+			this->spill();
+		}
+		std::vector<T>().swap(this->buffer);
+		while (this->runs.size() > this->fanIn) {
+			this->mergeLast(std::min(this->fanIn, this->runs.size() - this->fanIn + 1));
+		}
+		for (auto& run : this->runs) {
+			this->readers.push_back(Reader{ run });
+		}
+		this->startMerge(this->readers, this->heap);
+	}
+
+	// the records in order; false at the end
+	bool next(T& record) {
+		if (this->runs.empty()) {
+			if (this->position == this->buffer.size()) {
+				return false;
+			}
+			record = this->buffer[this->position++];
+			return true;
+		}
+		return this->takeNext(this->readers, this->heap, record);
+	}
+
+	// the spill file could not be written or read
+	bool hasFailed() {
+		return this->failed;
+	}
+};
+
+/* Checks the logs written with --log-dir:
+* - no node delivers the same operation twice
+* - any two nodes deliver the operations they both got in the same order
+*   (operations are matched by id, since the ts of a notification differs between nodes)
+* - nodes subscribed to the same variable end with the same value
+* Memory stays bounded: the logs are sorted by id and merged, and the pairs of positions
+* found for each two nodes are sorted again by position, all through ExternalSorter.
+* Each of the two sorts spills to a single temporary file.
+* nodes is the number of nodes of the run, node 0 included; if it is 0, the nodes are
+* taken from the files in dir. A node without a log is a problem.
+* Returns the number of problems found.
+*/
+int verifyLogs(std::string dir, int nodes = 0);
@@ -1,6 +1,13 @@
 #include <iostream>
-#include <mpi.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
 #include "Process.h"
+#include "MpiTransport.h"
+#include "ThreadTransport.h"
+#include "Trace.h"
+#include "Verifier.h"
 
 /* Notes:
 - USE ONLY SINGLE CHARACTER VARIABLES
@@ -44,18 +51,38 @@
 
 */
 
-void worker(int my_rank) {
+// command line options
+struct Options {
+    std::string checkpointDir; // if set, each worker checkpoints its state to <checkpointDir>/process<rank>.ckpt
+    int checkpointInterval = 1; // checkpoint every checkpointInterval delivered notifications
+    bool rejoin = false; // restart from the checkpoint and fetch only the missed updates from a peer
+    int threads = 0; // if set, run this many nodes as threads of one process instead of MPI processes
+    int maxLatencyMicros = 0; // threaded nodes only: delay every message by up to this much
+    bool reorder = false; // threaded nodes only: random delays, so messages from different nodes can overtake each other
+    std::string traceDir; // if set, every node records its messages to <traceDir>/trace<rank>.bin
+    std::string replayFile; // play this trace back to the node that recorded it, without MPI
+    int batchSize = 1; // hand notifications to the app in batches of up to this many
+    int batchDelayMicros = 0; // ... but never hold a notification back longer than this
+    std::string logDir; // if set, every worker writes its log and memory to <logDir>/log<rank>.txt and memory<rank>.txt
+    std::string verifyDir; // check that the logs written to this directory are consistent
+    int verifyNodes = 0; // ... for a run of this many nodes (0: as many as there are files for)
+};
+
+void worker(Transport* transport, Options options) {
     // each worker corresponds to a process
-    Process* process = new Process(my_rank);
+    int my_rank = transport->getRank();
+    Process* process = new Process(my_rank, transport);
+    process->setBatching(options.batchSize, options.batchDelayMicros);
+    // the app: count what it gets, to show how the notifications were batched
+    int nr_batches = 0, nr_notifications = 0;
+    process->setNotificationHandler([&nr_batches, &nr_notifications](const SetOperationFramework* notifications, int count) {
+        nr_batches++;
+        nr_notifications += count;
+    });
     // receive variables it is subscribed to
-    MPI_Status status;
-    int nr_variables;
-    MPI_Recv(&nr_variables, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
-
-    int parent = status.MPI_SOURCE;
-    std::vector<char> variables;
-    variables.resize(nr_variables);
-    MPI_Recv(variables.data(), nr_variables, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
+    int parent;
+    int nr_variables = transport->receiveInt(0, &parent);
+    std::vector<int> variables = transport->receive(0).data;
 
     // subscribe to the received variables
     for (int i = 0; i < nr_variables; i++) {
@@ -64,20 +91,26 @@ void worker(int my_rank) {
 
     // wait for other neighbours subscribed to other variables
     int other_count = 0, other, var;
-    MPI_Recv(&other_count, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
+    other_count = transport->receiveInt(0);
     for (int i = 0; i < other_count; i++) {
-        MPI_Recv(&var, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
-        MPI_Recv(&other, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
+        var = transport->receiveInt(0);
+        other = transport->receiveInt(0);
         process->addOtherSubscriber(std::string(1, var), other);
     }
 
     // now receive the operations to be performed
-    int nr_operations, val;
-    MPI_Recv(&nr_operations, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
+    int nr_operations, val, type;
+    nr_operations = transport->receiveInt(0);
     for (int i = 0; i < nr_operations; i++) {
-        MPI_Recv(&var, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
-        MPI_Recv(&val, 1, MPI_INT, 0, 123, MPI_COMM_WORLD, &status);
-        process->addSetOperation(std::string(1, var), val);
+        var = transport->receiveInt(0);
+        val = transport->receiveInt(0);
+        type = transport->receiveInt(0);
+        if (type == OP_SET) {
+            process->addSetOperation(std::string(1, var), val);
+        }
+        else {
+            process->addSubscriptionOperation(std::string(1, var), type);
+        }
     }
 
     // iterate over each operation to be performed
@@ -85,15 +118,41 @@ void worker(int my_rank) {
     int ts;
     int code_send = 8; // code for the prepare messages
     int code_received = 0; // if -1 then stop
-    bool first_time = true;
     SetOperationFramework sof;
     SetOperation so;
+
+    if (!options.checkpointDir.empty()) {
+        std::string path = options.checkpointDir + "/process" + std::to_string(my_rank) + ".ckpt";
+        process->enableCheckpoints(path, options.checkpointInterval);
+        if (options.rejoin && process->loadCheckpoint(path)) {
+            // ask peers only for the updates delivered after our checkpoint, each variable from a peer holding it
+            code_send = 11;
+            for (auto& request : process->getRejoinRequests()) {
+                transport->sendInt(request.first, code_send);
+                transport->send(request.first, request.second);
+            }
+        }
+    }
+
+    // run until node 0 sees that every node is done and stops us
     while (code_received != -1) {
-        if (!first_time) {
-            MPI_Recv(&code_received, 1, MPI_INT, MPI_ANY_SOURCE, 123, MPI_COMM_WORLD, &status);
-            parent = status.MPI_SOURCE;
+        if (process->canRunNextOperation()) {
+            code_received = 0;
+        }
+        else {
+            // a partial batch must not wait for the next message longer than its delay
+            long long wait = process->getMicrosUntilBatchDue();
+            Message message;
+            if (wait < 0) {
+                message = transport->receive(ANY_SOURCE);
+            }
+            else if (!transport->tryReceive(ANY_SOURCE, wait, message)) {
+                process->flushNotificationsIfDue();
+                continue;
+            }
+            code_received = message.data[0];
+            parent = message.source;
         }
-        first_time = false;
         switch (code_received) {
         case(0):
             // select a set operation
@@ -103,7 +162,30 @@ void worker(int my_rank) {
 
             if (variable == "NONE" && val == -1) {
                 // no more set operations
-                code_received = -1;
+                break;
+            }
+
+            if (so.type != OP_SET) {
+                // tell the other subscribers of the variable that we join or leave
+                if (so.type == OP_SUBSCRIBE) {
+                    process->subscribeToVar(variable);
+                    code_send = 13;
+                }
+                else {
+                    process->unsubscribeFromVar(variable);
+                    code_send = 14;
+                }
+                process->incrementTs();
+                ts = process->getTs();
+                std::vector<int> pids = process->getSubscribersForVariable(variable);
+                for (auto pid : pids) {
+                    transport->sendInt(pid, code_send);
+                    transport->sendInt(pid, variable[0]);
+                    transport->sendInt(pid, ts);
+                }
+                // the next operation waits until every one of them applied the change
+                process->expectReplies(pids.size());
+                process->saveCheckpoint();
                 break;
             }
 
@@ -112,6 +194,8 @@ void worker(int my_rank) {
             sof.var = variable;
             sof.val = val;
             sof.ts = process->getTs();
+            sof.origin = my_rank;
+            sof.seq = process->getRunningOperationIndex();
             process->addFrameworkOperation(sof);
 
             // iterate over each subscriber to the variable of the selected operation
@@ -121,22 +205,29 @@ void worker(int my_rank) {
                     process->incrementTs();
                     ts = process->getTs();
                     code_send = 8;
-                    MPI_Send(&code_send, 1, MPI_INT, pid, 123, MPI_COMM_WORLD);
-                    MPI_Send(&variable[0], 1, MPI_INT, pid, 123, MPI_COMM_WORLD);
-                    MPI_Send(&val, 1, MPI_INT, pid, 123, MPI_COMM_WORLD);
-                    MPI_Send(&ts, 1, MPI_INT, pid, 123, MPI_COMM_WORLD);
+                    transport->sendInt(pid, code_send);
+                    transport->sendInt(pid, variable[0]);
+                    transport->sendInt(pid, val);
+                    transport->sendInt(pid, ts);
                 }
             }
-            code_received = 0;
+            // the operation counts as run from now on, also after a restart
+            process->saveCheckpoint();
+            if (process->receivedAllPrepareResponses(variable)) {
+                // nobody else holds the variable, so there is nothing to wait for
+                process->sendTriplets(my_rank);
+                process->sendNotificationsFromFramework();
+                process->applySubscriptionChanges();
+            }
             break;
         case(-1):
             // stop listening
             break;
         case(8):
             // receiving a prepare message
-            MPI_Recv(&var, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&val, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&ts, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
+            var = transport->receiveInt(parent);
+            val = transport->receiveInt(parent);
+            ts = transport->receiveInt(parent);
             // update timestamp of the current process
             process->setTs(std::max(ts, process->getTs()) + 1);
             ts = process->getTs();
@@ -145,18 +236,18 @@ void worker(int my_rank) {
 
             // send a response to the prepare message sender
             code_send = 9; // code for sending back a response to a prepare message
-            MPI_Send(&code_send, 1, MPI_INT, parent, 123, MPI_COMM_WORLD);
+            transport->sendInt(parent, code_send);
             // send the variable and the new timestamp
-            MPI_Send(&var, 1, MPI_INT, parent, 123, MPI_COMM_WORLD);
-            MPI_Send(&val, 1, MPI_INT, parent, 123, MPI_COMM_WORLD);
-            MPI_Send(&ts, 1, MPI_INT, parent, 123, MPI_COMM_WORLD);
+            transport->sendInt(parent, var);
+            transport->sendInt(parent, val);
+            transport->sendInt(parent, ts);
             break;
         case(9):
             // receiving a response to a prepare message sent from this process
             // receive the variable and the new timestamp
-            MPI_Recv(&var, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&val, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&ts, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
+            var = transport->receiveInt(parent);
+            val = transport->receiveInt(parent);
+            ts = transport->receiveInt(parent);
             // change the ts of the current process
             process->setTs(std::max(ts, process->getTs()) + 1);
             ts = process->getTs();
@@ -170,18 +261,23 @@ void worker(int my_rank) {
                 process->updateLocalSetOperationTimestamp();
                 // send the triplets to the frameworks
                 process->sendTriplets(my_rank);
+                process->sendNotificationsFromFramework();
+                // subscription changes that were waiting for our set operation
+                process->applySubscriptionChanges();
             }
             break;
         case(10):
             // receive the set operation from the other party
-            MPI_Recv(&var, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&val, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
-            MPI_Recv(&ts, 1, MPI_INT, parent, 123, MPI_COMM_WORLD, &status);
+            var = transport->receiveInt(parent);
+            val = transport->receiveInt(parent);
+            ts = transport->receiveInt(parent);
+            sof.origin = transport->receiveInt(parent);
+            sof.seq = transport->receiveInt(parent);
             // increment the ts
             process->setTs(std::max(ts, process->getTs()) + 1);
 
-            // close the prepare
-            process->closePrepare(std::string(1, var));
+            // close the prepare of its sender; others on the same variable stay open
+            process->closePrepare(std::string(1, var), parent);
 
             // store the set operation in the framework
             sof.var = std::string(1, var);
@@ -189,55 +285,137 @@ void worker(int my_rank) {
             sof.ts = ts;
             process->addFrameworkOperation(sof);
 
-            // check for failed messages and retry sending them
-            process->retrySendingFailedTriplets();
-
-            // now check if you've received all operations for the prepare messages received
-            if (process->receivedAllOperationsForPrepares()) {
-                process->sendNotificationsFromFramework();
+            // deliver what can no longer be overtaken by an open prepare
+            process->sendNotificationsFromFramework();
+            // subscription changes that were waiting for this set operation
+            process->applySubscriptionChanges();
+            // keep running: peers may still need us (rejoin requests, subscriptions)
+            break;
+        case(11): {
+            // a restarted process asks for the operations delivered after its checkpoint
+            std::vector<int> cursors = transport->receive(parent).data; // <var, delivered count> for each variable
+            std::vector<int> entries = process->getDeliveredAfter(cursors); // <var, val, ts, origin, seq> for each missed operation
+            int nr_missed = entries.size() / MISSED_ENTRY_INTS;
+            code_send = 12; // code for the state transfer
+            transport->sendInt(parent, code_send);
+            transport->sendInt(parent, nr_missed);
+            if (nr_missed > 0) {
+                transport->send(parent, entries);
+            }
+            break;
+        }
+        case(12): {
+            // receiving the operations we missed while we were down
+            int nr_missed;
+            nr_missed = transport->receiveInt(parent);
+            std::vector<int> entries;
+            if (nr_missed > 0) {
+                entries = transport->receive(parent).data;
+            }
+            std::cout << "[" << my_rank << "]Received " << nr_missed << " missed operations from " << parent << "\n";
+            if (process->storeRejoinReply(entries)) {
+                std::cout << "[" << my_rank << "]Rejoined\n";
+                process->saveCheckpoint();
+            }
+            break;
+        }
+        case(13):
+        case(14):
+            // another process subscribes to / unsubscribes from a variable
+            var = transport->receiveInt(parent);
+            ts = transport->receiveInt(parent);
+            process->setTs(std::max(ts, process->getTs()) + 1);
+            // ordered after any set operation on the variable that is still open
+            process->storeSubscriptionChange(std::string(1, var), parent, code_received == 13 ? OP_SUBSCRIBE : OP_UNSUBSCRIBE, process->getTs());
+            process->applySubscriptionChanges();
+            break;
+        case(15): {
+            // snapshot of a variable we just subscribed to
+            var = transport->receiveInt(parent);
+            val = transport->receiveInt(parent);
+            ts = transport->receiveInt(parent);
+            std::vector<int> pids = transport->receive(parent).data;
+            std::vector<int> known = process->getSubscribersForVariable(std::string(1, var));
+            process->setTs(std::max(ts, process->getTs()) + 1);
+            process->setValueForVariable(std::string(1, var), val);
+            process->setSubscribersForVariable(std::string(1, var), pids);
+            process->addLog("SNAPSHOT(" + std::string(1, var) + "," + std::to_string(val) + ") ts=" + std::to_string(ts));
+            process->receivedReply();
+            // subscribers node 0 did not tell us about have not heard of us yet
+            code_send = 13;
+            for (auto pid : process->getSubscribersForVariable(std::string(1, var))) {
+                if (std::find(known.begin(), known.end(), pid) == known.end()) {
+                    transport->sendInt(pid, code_send);
+                    transport->sendInt(pid, var);
+                    transport->sendInt(pid, process->getTs());
+                    process->expectReplies(1);
+                }
             }
-
-            // stop parent process
-            code_received = -1;
-            //code_send = -1;
-            //MPI_Send(&code_send, 1, MPI_INT, parent, 123, MPI_COMM_WORLD);
             break;
+        }
+        case(16):
+            // a subscriber applied our subscribe / unsubscribe
+            process->receivedReply();
+            break;
+        case(18): {
+            // node 0 asks whether we are done: <idle, messages sent to peers, messages received from peers>
+            std::vector<int> state{ process->isIdle() ? 1 : 0, (int)transport->getPeerSent(), (int)transport->getPeerReceived() };
+            transport->send(0, state);
+            break;
+        }
         default:
             std::cout << "Error: invalid code received in process " << my_rank << "; code=" << code_received << '\n';
             code_received = -1;
             break;
         }
+        // deliver a partial batch that has waited long enough
+        process->flushNotificationsIfDue();
     }
 
     // at the end, display the memory and the log messages
+    process->flushNotifications();
+    process->saveCheckpoint();
     process->displayMemory();
     process->displayLog();
+    std::cout << "[" << my_rank << "]Got " << nr_notifications << " notifications in " << nr_batches << " batches\n";
+    if (!options.logDir.empty()) {
+        process->saveLogs(options.logDir + "/log" + std::to_string(my_rank) + ".txt", options.logDir + "/memory" + std::to_string(my_rank) + ".txt");
+    }
+}
+
+void sendTriplet(Transport* transport, char var, int dest, int other) {
+    transport->sendInt(dest, var);
+    transport->sendInt(dest, other);
 }
 
-void sendTriplet(char var, int dest, int other) {
-    MPI_Send(&var, 1, MPI_INT, dest, 123, MPI_COMM_WORLD);
-    MPI_Send(&other, 1, MPI_INT, dest, 123, MPI_COMM_WORLD);
+void sendOperation(Transport* transport, char var, int val, int dest, int type = OP_SET) {
+    transport->sendInt(dest, var);
+    transport->sendInt(dest, val);
+    transport->sendInt(dest, type);
 }
 
-void sendOperation(char var, int val, int dest) {
-    MPI_Send(&var, 1, MPI_INT, dest, 123, MPI_COMM_WORLD);
-    MPI_Send(&val, 1, MPI_INT, dest, 123, MPI_COMM_WORLD);
+void sendSubscribe(Transport* transport, char var, int dest) {
+    sendOperation(transport, var, -1, dest, OP_SUBSCRIBE);
 }
 
-void example1(int noProcs) {
+void sendUnsubscribe(Transport* transport, char var, int dest) {
+    sendOperation(transport, var, -1, dest, OP_UNSUBSCRIBE);
+}
+
+void example1(Transport* transport) {
     // example 1 (the one from the lecture page)
     std::vector<int> processes;
     // send variables X, Y to p1
-    std::vector<char> variables_1{ 'X', 'Y' };
+    std::vector<int> variables_1{ 'X', 'Y' };
     int nr_variables_1 = variables_1.size();
-    MPI_Send(&nr_variables_1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_1.data(), nr_variables_1, MPI_INT, 1, 123, MPI_COMM_WORLD);
+    transport->sendInt(1, nr_variables_1);
+    transport->send(1, variables_1);
 
     // send variables X, Y to p2
-    std::vector<char> variables_2{ 'X', 'Y' };
+    std::vector<int> variables_2{ 'X', 'Y' };
     int nr_variables_2 = variables_2.size();
-    MPI_Send(&nr_variables_2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_2.data(), nr_variables_2, MPI_INT, 2, 123, MPI_COMM_WORLD);
+    transport->sendInt(2, nr_variables_2);
+    transport->send(2, variables_2);
 
     processes.push_back(1);
     processes.push_back(2);
@@ -245,50 +423,50 @@ void example1(int noProcs) {
     // send to each process, for each variable, all other process ids that subscribed to that variable
     // first send how many triples will be sent
     int for_p1 = 2, for_p2 = 2;
-    MPI_Send(&for_p1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    MPI_Send(&for_p2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
+    transport->sendInt(1, for_p1);
+    transport->sendInt(2, for_p2);
     // for X, send p2 to p1
-    sendTriplet('X', 1, 2);
+    sendTriplet(transport, 'X', 1, 2);
     // for Y, send p2 to p1
-    sendTriplet('Y', 1, 2);
+    sendTriplet(transport, 'Y', 1, 2);
     // for X, send p1 to p2
-    sendTriplet('X', 2, 1);
+    sendTriplet(transport, 'X', 2, 1);
     // for Y, send p1 to p2
-    sendTriplet('Y', 2, 1);
+    sendTriplet(transport, 'Y', 2, 1);
 
     // send to each process the operations to be performed
     // send Set(X, 5) to p1
     int nr_operations_1 = 1;
-    MPI_Send(&nr_operations_1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    sendOperation('X', 5, 1);
+    transport->sendInt(1, nr_operations_1);
+    sendOperation(transport, 'X', 5, 1);
     // send Set(Y, 7) to p1
     int nr_operations_2 = 1;
-    MPI_Send(&nr_operations_2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
-    sendOperation('Y', 7, 2);
+    transport->sendInt(2, nr_operations_2);
+    sendOperation(transport, 'Y', 7, 2);
 }
 
-void example2(int noProcs) {
+void example2(Transport* transport) {
     // example 2 (the one from the lecture class)
     std::vector<int> processes;
     // send variables A, B, E to p1 and p2
-    std::vector<char> variables_1{ 'A', 'B', 'E' };
-    std::vector<char> variables_2{ 'A', 'B', 'E' };
+    std::vector<int> variables_1{ 'A', 'B', 'E' };
+    std::vector<int> variables_2{ 'A', 'B', 'E' };
     int nr_variables_1 = variables_1.size();
     int nr_variables_2 = variables_2.size();
-    MPI_Send(&nr_variables_1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_1.data(), nr_variables_1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    MPI_Send(&nr_variables_2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_2.data(), nr_variables_2, MPI_INT, 2, 123, MPI_COMM_WORLD);
+    transport->sendInt(1, nr_variables_1);
+    transport->send(1, variables_1);
+    transport->sendInt(2, nr_variables_2);
+    transport->send(2, variables_2);
 
     // send variables C, D, E to p3 and p4
-    std::vector<char> variables_3{ 'C', 'D', 'E' };
-    std::vector<char> variables_4{ 'C', 'D', 'E' };
+    std::vector<int> variables_3{ 'C', 'D', 'E' };
+    std::vector<int> variables_4{ 'C', 'D', 'E' };
     int nr_variables_3 = variables_3.size();
     int nr_variables_4 = variables_4.size();
-    MPI_Send(&nr_variables_3, 1, MPI_INT, 3, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_3.data(), nr_variables_3, MPI_INT, 3, 123, MPI_COMM_WORLD);
-    MPI_Send(&nr_variables_4, 1, MPI_INT, 4, 123, MPI_COMM_WORLD);
-    MPI_Ssend(variables_4.data(), nr_variables_4, MPI_INT, 4, 123, MPI_COMM_WORLD);
+    transport->sendInt(3, nr_variables_3);
+    transport->send(3, variables_3);
+    transport->sendInt(4, nr_variables_4);
+    transport->send(4, variables_4);
 
     processes.push_back(1);
     processes.push_back(2);
@@ -298,90 +476,343 @@ void example2(int noProcs) {
     // send to each process, for each variable, all other process ids that subscribed to that variable
     // first send how many triples will be sent
     int for_p1 = 4, for_p2 = 4, for_p3 = 3, for_p4 = 3;
-    MPI_Send(&for_p1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    MPI_Send(&for_p2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
-    MPI_Send(&for_p3, 1, MPI_INT, 3, 123, MPI_COMM_WORLD);
-    MPI_Send(&for_p4, 1, MPI_INT, 4, 123, MPI_COMM_WORLD);
+    transport->sendInt(1, for_p1);
+    transport->sendInt(2, for_p2);
+    transport->sendInt(3, for_p3);
+    transport->sendInt(4, for_p4);
     // for A, send p2 to p1
-    sendTriplet('A', 1, 2);
+    sendTriplet(transport, 'A', 1, 2);
     // for B, send p2 to p1
-    sendTriplet('B', 1, 2);
+    sendTriplet(transport, 'B', 1, 2);
     // for E, send p2 to p1
-    sendTriplet('E', 1, 2);
+    sendTriplet(transport, 'E', 1, 2);
     // for A, send p1 to p2
-    sendTriplet('A', 2, 1);
+    sendTriplet(transport, 'A', 2, 1);
     // for B, send p1 to p2
-    sendTriplet('B', 2, 1);
+    sendTriplet(transport, 'B', 2, 1);
     // for E, send p2 to p1
-    sendTriplet('E', 2, 1);
+    sendTriplet(transport, 'E', 2, 1);
     // for C, send p4 to p3
-    sendTriplet('C', 3, 4);
+    sendTriplet(transport, 'C', 3, 4);
     // for D, send p4 to p3
-    sendTriplet('D', 3, 4);
+    sendTriplet(transport, 'D', 3, 4);
     // for E, send p4 to p3
-    sendTriplet('E', 3, 4);
+    sendTriplet(transport, 'E', 3, 4);
     // for C, send p3 to p4
-    sendTriplet('C', 4, 3);
+    sendTriplet(transport, 'C', 4, 3);
     // for D, send p3 to p4
-    sendTriplet('D', 4, 3);
+    sendTriplet(transport, 'D', 4, 3);
     // for E, send p3 to p4
-    sendTriplet('E', 4, 3);
+    sendTriplet(transport, 'E', 4, 3);
 
     // send to each process the operations to be performed
     // send 4 operations to p1
     int nr_operations_1 = 4;
-    MPI_Send(&nr_operations_1, 1, MPI_INT, 1, 123, MPI_COMM_WORLD);
-    sendOperation('A', 5, 1);
-    sendOperation('B', 4, 1);
-    sendOperation('A', 6, 1);
-    sendOperation('E', 7, 1);
-    // send 4 operations to p2
-    int nr_operations_2 = 4;
-    MPI_Send(&nr_operations_2, 1, MPI_INT, 2, 123, MPI_COMM_WORLD);
-    sendOperation('A', 5, 2);
-    sendOperation('B', 4, 2);
-    sendOperation('A', 6, 2);
-    sendOperation('E', 7, 2);
-    sendOperation('Y', 7, 2);
+    transport->sendInt(1, nr_operations_1);
+    sendOperation(transport, 'A', 5, 1);
+    sendOperation(transport, 'B', 4, 1);
+    sendOperation(transport, 'A', 6, 1);
+    sendOperation(transport, 'E', 7, 1);
+    // send 5 operations to p2
+    int nr_operations_2 = 5;
+    transport->sendInt(2, nr_operations_2);
+    sendOperation(transport, 'A', 5, 2);
+    sendOperation(transport, 'B', 4, 2);
+    sendOperation(transport, 'A', 6, 2);
+    sendOperation(transport, 'E', 7, 2);
+    sendOperation(transport, 'Y', 7, 2);
     // send 3 operations to p3
     int nr_operations_3 = 3;
-    MPI_Send(&nr_operations_3, 1, MPI_INT, 3, 123, MPI_COMM_WORLD);
-    sendOperation('C', 4, 3);
-    sendOperation('C', 5, 3);
-    sendOperation('E', 7, 3);
+    transport->sendInt(3, nr_operations_3);
+    sendOperation(transport, 'C', 4, 3);
+    sendOperation(transport, 'C', 5, 3);
+    sendOperation(transport, 'E', 7, 3);
     // send 3 operations to p4
     int nr_operations_4 = 3;
-    MPI_Send(&nr_operations_4, 1, MPI_INT, 4, 123, MPI_COMM_WORLD);
-    sendOperation('C', 4, 4);
-    sendOperation('C', 5, 4);
-    sendOperation('E', 7, 4);
+    transport->sendInt(4, nr_operations_4);
+    sendOperation(transport, 'C', 4, 4);
+    sendOperation(transport, 'C', 5, 4);
+    sendOperation(transport, 'E', 7, 4);
 }
 
-// run using:
-// - mpiexec -n 3 lab8
-// - mpiexec -n 5 lab8
-int main()
-{
-    MPI_Init(NULL, NULL);
+void example3(Transport* transport) {
+    // example 1, plus a third process that joins X and leaves it again
+    // send variables X, Y to p1 and p2, and Z to p3
+    std::vector<int> variables_1{ 'X', 'Y' };
+    std::vector<int> variables_2{ 'X', 'Y' };
+    std::vector<int> variables_3{ 'Z' };
+    int nr_variables_1 = variables_1.size();
+    int nr_variables_2 = variables_2.size();
+    int nr_variables_3 = variables_3.size();
+    transport->sendInt(1, nr_variables_1);
+    transport->send(1, variables_1);
+    transport->sendInt(2, nr_variables_2);
+    transport->send(2, variables_2);
+    transport->sendInt(3, nr_variables_3);
+    transport->send(3, variables_3);
+
+    // send to each process, for each variable, all other process ids that subscribed to that variable
+    // p3 also gets the subscribers of X, so its SUBSCRIBE knows whom to tell
+    int for_p1 = 2, for_p2 = 2, for_p3 = 2;
+    transport->sendInt(1, for_p1);
+    transport->sendInt(2, for_p2);
+    transport->sendInt(3, for_p3);
+    sendTriplet(transport, 'X', 1, 2);
+    sendTriplet(transport, 'Y', 1, 2);
+    sendTriplet(transport, 'X', 2, 1);
+    sendTriplet(transport, 'Y', 2, 1);
+    sendTriplet(transport, 'X', 3, 1);
+    sendTriplet(transport, 'X', 3, 2);
+
+    // send to each process the operations to be performed
+    // send Set(X, 5) to p1
+    int nr_operations_1 = 1;
+    transport->sendInt(1, nr_operations_1);
+    sendOperation(transport, 'X', 5, 1);
+    // send Set(Y, 7) to p2
+    int nr_operations_2 = 1;
+    transport->sendInt(2, nr_operations_2);
+    sendOperation(transport, 'Y', 7, 2);
+    // send Subscribe(X), Unsubscribe(X) to p3
+    int nr_operations_3 = 2;
+    transport->sendInt(3, nr_operations_3);
+    sendSubscribe(transport, 'X', 3);
+    sendUnsubscribe(transport, 'X', 3);
+}
+
+void exampleN(Transport* transport) {
+    // any number of nodes: example 1 on p1 and p2; every other process sets Z, which all of them
+    // hold, so the SETs to order grow with the number of nodes, then joins X and leaves it again
+    int noProcs = transport->getSize();
+    std::vector<int> variables_1{ 'X', 'Y' };
+    std::vector<int> variables_2{ 'X', 'Y' };
+    std::vector<int> variables_others{ 'Z' };
+    int nr_variables_1 = variables_1.size();
+    int nr_variables_2 = variables_2.size();
+    int nr_variables_others = variables_others.size();
+    transport->sendInt(1, nr_variables_1);
+    transport->send(1, variables_1);
+    transport->sendInt(2, nr_variables_2);
+    transport->send(2, variables_2);
+    for (int pid = 3; pid < noProcs; pid++) {
+        transport->sendInt(pid, nr_variables_others);
+        transport->send(pid, variables_others);
+    }
+
+    // send to each process, for each variable, all other process ids that subscribed to that variable
+    // the others get each other for Z, and the subscribers of X, so their SUBSCRIBE knows whom to tell
+    int for_p1 = 2, for_p2 = 2, for_others = 2 + noProcs - 4;
+    transport->sendInt(1, for_p1);
+    sendTriplet(transport, 'X', 1, 2);
+    sendTriplet(transport, 'Y', 1, 2);
+    transport->sendInt(2, for_p2);
+    sendTriplet(transport, 'X', 2, 1);
+    sendTriplet(transport, 'Y', 2, 1);
+    for (int pid = 3; pid < noProcs; pid++) {
+        transport->sendInt(pid, for_others);
+        for (int other = 3; other < noProcs; other++) {
+            if (other != pid) {
+                sendTriplet(transport, 'Z', pid, other);
+            }
+        }
+        sendTriplet(transport, 'X', pid, 1);
+        sendTriplet(transport, 'X', pid, 2);
+    }
 
-    int my_rank, noProcs;
-    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &noProcs);
+    // send to each process the operations to be performed
+    int nr_operations_1 = 1;
+    transport->sendInt(1, nr_operations_1);
+    sendOperation(transport, 'X', 5, 1);
+    int nr_operations_2 = 1;
+    transport->sendInt(2, nr_operations_2);
+    sendOperation(transport, 'Y', 7, 2);
+    int nr_operations_others = 3;
+    for (int pid = 3; pid < noProcs; pid++) {
+        transport->sendInt(pid, nr_operations_others);
+        sendOperation(transport, 'Z', pid, pid);
+        sendSubscribe(transport, 'X', pid);
+        sendUnsubscribe(transport, 'X', pid);
+    }
+}
+
+void waitForWorkers(Transport* transport) {
+    // the run is over once every worker is idle and no message between workers is in flight;
+    // two rounds in a row must agree, since a worker may get a message right after it answered
+    int noProcs = transport->getSize();
+    int code_send = 18; // code for asking a worker whether it is done
+    long long lastSent = -1, lastReceived = -1;
+    while (true) {
+        for (int pid = 1; pid < noProcs; pid++) {
+            transport->sendInt(pid, code_send);
+        }
+        bool idle = true;
+        long long sent = 0, received = 0;
+        for (int pid = 1; pid < noProcs; pid++) {
+            std::vector<int> state = transport->receive(pid).data;
+            idle = idle && state[0] == 1;
+            sent += state[1];
+            received += state[2];
+        }
+        if (idle && sent == received && sent == lastSent && received == lastReceived) {
+            break;
+        }
+        lastSent = idle ? sent : -1;
+        lastReceived = idle ? received : -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // stop the workers
+    code_send = -1;
+    for (int pid = 1; pid < noProcs; pid++) {
+        transport->sendInt(pid, code_send);
+    }
+}
+
+void runNode(Transport* transport, Options options) {
+    TraceTransport* traced = nullptr;
+    if (!options.traceDir.empty()) {
+        traced = new TraceTransport(transport, options.traceDir + "/trace" + std::to_string(transport->getRank()) + ".bin");
+        transport = traced;
+    }
+    int my_rank = transport->getRank();
+    int noProcs = transport->getSize();
+    if (noProcs < 3) {
+        // the examples need node 0 and at least two workers sharing a variable
+        std::cout << "Error: at least 3 nodes are needed, got " << noProcs << '\n';
+        delete traced;
+        return;
+    }
 
     if (my_rank == 0) {
         // parent
         if (noProcs == 3) {
-            example1(noProcs - 1);
+            example1(transport);
+        }
+        else if (noProcs == 4) {
+            example3(transport);
         }
         else if (noProcs == 5) {
-            example2(noProcs - 1);
+            example2(transport);
+        }
+        else {
+            exampleN(transport);
         }
+        waitForWorkers(transport);
     }
     else {
         // worker
-        worker(my_rank);
+        worker(transport, options);
+    }
+    delete traced;
+}
+
+void runThreads(Options options) {
+    // every node gets its own thread and talks to the others through in-memory mailboxes
+    ThreadNetwork network(options.threads, options.maxLatencyMicros, options.reorder);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> nodes;
+    for (int rank = 0; rank < options.threads; rank++) {
+        nodes.push_back(std::thread([&network, options, rank]() {
+            ThreadTransport transport(&network, rank);
+            runNode(&transport, options);
+        }));
     }
-    
+    for (auto& node : nodes) {
+        node.join();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[threads]" << options.threads << " nodes finished in " << elapsed << "us\n";
+}
+
+void runReplay(Options options) {
+    ReplayTransport transport;
+    if (!transport.load(options.replayFile)) {
+        std::cout << "Error: could not read trace " << options.replayFile << '\n';
+        return;
+    }
+    // the node must not record again or overwrite the files of the real run
+    options.traceDir = "";
+    options.checkpointDir = "";
+    options.logDir = "";
+    auto start = std::chrono::steady_clock::now();
+    runNode(&transport, options);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[replay]node " << transport.getRank() << ": " << transport.getReceived() << " messages in, "
+        << transport.getSent() << " out, " << transport.getMismatches() << " different from the trace, " << elapsed << "us\n";
+}
+
+// run using:
+// - mpiexec -n 3 lab8
+// - mpiexec -n 4 lab8 (p3 subscribes to X and unsubscribes again)
+// - mpiexec -n 5 lab8
+// - mpiexec -n 3 lab8 --checkpoint-dir <dir> [--checkpoint-interval <n>] [--rejoin]
+// - mpiexec -n <N> lab8, any other N >= 3 (p1, p2 as in example 1, the others set Z, then join and leave X)
+// - lab8 --threads <N> [--latency <max us>] [--reorder] (no MPI, nodes are threads)
+// - mpiexec -n 3 lab8 --trace-dir <dir>, then lab8 --replay <dir>/trace1.bin
+// - mpiexec -n 3 lab8 --batch-size <n> [--batch-delay <max us>]
+// - mpiexec -n 3 lab8 --log-dir <dir>, then lab8 --verify <dir> [--nodes 3]
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--checkpoint-dir" && i + 1 < argc) {
+            options.checkpointDir = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            options.checkpointInterval = std::stoi(argv[++i]);
+        }
+        else if (arg == "--rejoin") {
+            options.rejoin = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::stoi(argv[++i]);
+        }
+        else if (arg == "--latency" && i + 1 < argc) {
+            options.maxLatencyMicros = std::stoi(argv[++i]);
+        }
+        else if (arg == "--reorder") {
+            options.reorder = true;
+        }
+        else if (arg == "--trace-dir" && i + 1 < argc) {
+            options.traceDir = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            options.replayFile = argv[++i];
+        }
+        else if (arg == "--batch-size" && i + 1 < argc) {
+            options.batchSize = std::stoi(argv[++i]);
+        }
+        else if (arg == "--batch-delay" && i + 1 < argc) {
+            options.batchDelayMicros = std::stoi(argv[++i]);
+        }
+        else if (arg == "--log-dir" && i + 1 < argc) {
+            options.logDir = argv[++i];
+        }
+        else if (arg == "--verify" && i + 1 < argc) {
+            options.verifyDir = argv[++i];
+        }
+        else if (arg == "--nodes" && i + 1 < argc) {
+            options.verifyNodes = std::stoi(argv[++i]);
+        }
+    }
+
+    if (!options.verifyDir.empty()) {
+        return verifyLogs(options.verifyDir, options.verifyNodes) == 0 ? 0 : 1;
+    }
+
+    if (!options.replayFile.empty()) {
+        runReplay(options);
+        return 0;
+    }
+
+    if (options.threads > 0) {
+        runThreads(options);
+        return 0;
+    }
+
+    MPI_Init(&argc, &argv);
+    MpiTransport transport;
+    runNode(&transport, options);
     MPI_Finalize();
 
     return 0;